@@ -11,14 +11,14 @@ PARAM_ENTRY Params[]=
 
 void getMillis(char **param, uint8_t parCnt)
 {
-  Serial.println(millis());
+  microbox.out.println(millis());
 }
 
 void freeRam(char **param, uint8_t parCnt) 
 {
   extern int __heap_start, *__brkval;
   int v;
-  Serial.println((int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval));
+  microbox.out.println((int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval));
 }
 
 void writePin(char **param, uint8_t parCnt)
@@ -31,7 +31,7 @@ void writePin(char **param, uint8_t parCnt)
         digitalWrite(pin, pinval);
     }
     else
-        Serial.println(F("Usage: writepin pinNum pinvalue"));
+        microbox.out.println(F("Usage: writepin pinNum pinvalue"));
 }
 
 void readPin(char **param, uint8_t parCnt)
@@ -40,10 +40,10 @@ void readPin(char **param, uint8_t parCnt)
     if(parCnt == 1)
     {
         pin = atoi(param[0]);
-        Serial.println(digitalRead(pin));
+        microbox.out.println(digitalRead(pin));
     }
     else
-        Serial.println(F("Usage: readpin pinNum"));
+        microbox.out.println(F("Usage: readpin pinNum"));
 }
 
 void setPinDirection(char **param, uint8_t parCnt)
@@ -60,7 +60,7 @@ void setPinDirection(char **param, uint8_t parCnt)
         pinMode(pin, pindir);
     }
     else
-        Serial.println(F("Usage: setpindir pinNum in|out"));
+        microbox.out.println(F("Usage: setpindir pinNum in|out"));
 }
 
 void readAnalogPin(char **param, uint8_t parCnt)
@@ -69,10 +69,10 @@ void readAnalogPin(char **param, uint8_t parCnt)
     if(parCnt == 1)
     {
         pin = atoi(param[0]);
-        Serial.println(analogRead(pin));
+        microbox.out.println(analogRead(pin));
     }
     else
-        Serial.println(F("Usage: readanalog pinNum"));
+        microbox.out.println(F("Usage: readanalog pinNum"));
 }
 
 void writeAnalogPin(char **param, uint8_t parCnt)
@@ -85,7 +85,45 @@ void writeAnalogPin(char **param, uint8_t parCnt)
         analogWrite(pin, pinval);
     }
     else
-        Serial.println(F("Usage: writeanalog pinNum pinvalue"));
+        microbox.out.println(F("Usage: writeanalog pinNum pinvalue"));
+}
+
+typedef struct
+{
+    uint8_t pin;
+    uint8_t count;
+    unsigned long lastToggle;
+}PULSE_STATE;
+
+// Resumable command, toggles a pin every 500ms without blocking loop()
+uint8_t pulsePin(char **param, uint8_t parCnt, CMD_STATE *pState)
+{
+    PULSE_STATE *pPulse = (PULSE_STATE*)pState->data;
+
+    if(pState->calls == 0)
+    {
+        if(parCnt != 2)
+        {
+            microbox.out.println(F("Usage: pulse pinNum count"));
+            return CMD_DONE;
+        }
+        pPulse->pin = atoi(param[0]);
+        pPulse->count = atoi(param[1]) * 2;
+        pPulse->lastToggle = millis();
+        pinMode(pPulse->pin, OUTPUT);
+    }
+    if(pState->cancel || pPulse->count == 0)
+    {
+        digitalWrite(pPulse->pin, 0);
+        return CMD_DONE;
+    }
+    if(millis() - pPulse->lastToggle >= 500)
+    {
+        pPulse->lastToggle += 500;
+        pPulse->count--;
+        digitalWrite(pPulse->pin, pPulse->count & 1);
+    }
+    return CMD_BUSY;
 }
 
 void setup()
@@ -95,6 +133,7 @@ void setup()
   microbox.begin(&Params[0], hostname, true, historyBuf, 100);
   microbox.AddCommand("free", freeRam);
   microbox.AddCommand("millis", getMillis);
+  microbox.AddCommand("pulse", pulsePin);
   microbox.AddCommand("readanalog", readAnalogPin);
   microbox.AddCommand("readpin", readPin);
   microbox.AddCommand("setpindir", setPinDirection);
@@ -54,14 +54,14 @@ void GetAnalogPin(uint8_t id)
 
 void getMillis(char **param, uint8_t parCnt)
 {
-    Serial.println(millis());
+    microbox.out.println(millis());
 }
 
 void freeRam(char **param, uint8_t parCnt) 
 {
     extern int __heap_start, *__brkval;
     int v;
-    Serial.println((int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval));
+    microbox.out.println((int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval));
 }
 
 void setup()
@@ -71,6 +71,9 @@ void setup()
     microbox.begin(&Params[0], hostname, true, historyBuf, 100);
     microbox.AddCommand("free", freeRam);
     microbox.AddCommand("millis", getMillis);
+    // analog reads are cached for 50ms
+    for(uint8_t i=0;i<ANALOG_PARAMS;i++)
+        microbox.SetMaxAge(Params[DIGI_PARAMS+i].paramName, 50);
 }
 
 void loop()
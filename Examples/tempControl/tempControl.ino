@@ -7,6 +7,12 @@
 #include <avr/wdt.h>
 
 char historyBuf[100];
+#if MB_CAPTURE
+PARAM_VALUE captureBuf[32];
+#endif
+#if MB_STATS
+double statBuf[20];
+#endif
 char hostname[] = "incubatDuino";
 
 uint8_t buf[2];
@@ -15,7 +21,7 @@ double tempFilter = 0;
 uint16_t filterCount = 25;
 uint16_t adval;
 uint16_t filterPos = 0;
-unsigned long lastADRead = 0;
+int8_t adTask = -1;
 double maxDiv = 0;
 
 uint16_t pidIntervall = 5000;
@@ -33,21 +39,21 @@ PID_ATune aTune(&temp, &Output);
 
 PARAM_ENTRY Params[]=
 {
-    {"ad_filtercnt", &filterCount, PARTYPE_INT | PARTYPE_RW, 0, NULL, NULL, 0},
-    {"ad_intervall", &adIntervall, PARTYPE_INT | PARTYPE_RW, 0, NULL, NULL, 0},
-    {"atune_lookback", &lookback, PARTYPE_INT | PARTYPE_RW, 0, NULL, NULL, 0},
-    {"atune_noiseband", &noiseband, PARTYPE_DOUBLE | PARTYPE_RW, 0, NULL, NULL, 0},
-    {"atune_status", &atuneMode, PARTYPE_INT | PARTYPE_RO, 0, NULL, NULL, 0},
-    {"hostname", hostname, PARTYPE_STRING | PARTYPE_RW, sizeof(hostname), NULL, NULL, 0},
-    {"max_div", &maxDiv, PARTYPE_DOUBLE | PARTYPE_RW, 0, NULL, NULL, 0},
-    {"pid_intervall", &pidIntervall, PARTYPE_INT | PARTYPE_RW, 0, PidSetIntervall, NULL, 0},
-    {"pid_kp", &Kp, PARTYPE_DOUBLE | PARTYPE_RW, 0, PidSetParams, NULL, 0},
-    {"pid_ki", &Ki, PARTYPE_DOUBLE | PARTYPE_RW, 0, PidSetParams, NULL, 0},
-    {"pid_kd", &Kd, PARTYPE_DOUBLE | PARTYPE_RW, 0, PidSetParams, NULL, 0},
-    {"power", &Output, PARTYPE_DOUBLE | PARTYPE_RO, 0, NULL, NULL, 0},
-    {"temp_act", &temp, PARTYPE_DOUBLE | PARTYPE_RO, 0, NULL, NULL, 0},
-    {"temp_setpoint", &Setpoint, PARTYPE_DOUBLE | PARTYPE_RW, 0, NULL, NULL, 0},
-    {NULL, NULL}
+    mb::param("ad_filtercnt", filterCount, mb::rw),
+    mb::param("ad_intervall", adIntervall, mb::rw, ADSetIntervall),
+    mb::param("atune_lookback", lookback, mb::rw),
+    mb::param("atune_noiseband", noiseband, mb::rw),
+    mb::param("atune_status", atuneMode, mb::ro),
+    mb::param("hostname", hostname, mb::rw),
+    mb::param("max_div", maxDiv, mb::rw),
+    mb::param("pid_intervall", pidIntervall, mb::rw, PidSetIntervall),
+    mb::param("pid_kp", Kp, mb::rw, PidSetParams),
+    mb::param("pid_ki", Ki, mb::rw, PidSetParams),
+    mb::param("pid_kd", Kd, mb::rw, PidSetParams),
+    mb::param("power", Output, mb::ro | mb::atomic),
+    mb::param("temp_act", temp, mb::ro | mb::atomic),
+    mb::param("temp_setpoint", Setpoint, mb::rw),
+    mb::end()
 };
 
 #define MAX_POWER_PORTS 1
@@ -110,7 +116,12 @@ void DoATune(char **param, uint8_t parCnt)
     aTune.SetNoiseBand(noiseband);
     aTune.SetLookbackSec(lookback);
 
-    Serial.println(F("Autotune started with setpoint=temp_act"));
+    microbox.out.println(F("Autotune started with setpoint=temp_act"));
+}
+
+void ADSetIntervall(uint8_t id)
+{
+    microbox.SetTaskPeriod(adTask, adIntervall);
 }
 
 void PidSetIntervall(uint8_t id)
@@ -127,7 +138,7 @@ void freeRam(char **param, uint8_t parCnt)
 {
     extern int __heap_start, *__brkval;
     int v;
-    Serial.println((int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval));
+    microbox.out.println((int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval));
 }
 
 void reset(char **param, uint8_t parCnt)
@@ -163,9 +174,19 @@ void setup()
     Timer1.attachInterrupt(Timer1cb);  // attaches callback() as a timer overflow interrupt
 
     microbox.begin(&Params[0], hostname, true, historyBuf, 100);
+#if MB_CAPTURE
+    microbox.SetCaptureBuffer(captureBuf, 32);
+#endif
+#if MB_STATS
+    microbox.SetStatBuffer(statBuf, 20);
+#endif
     microbox.AddCommand("atune", DoATune);
     microbox.AddCommand("free", freeRam);
     microbox.AddCommand("reset", reset);
+    adTask = microbox.AddTask(ADRead, adIntervall);
+#if MB_STATS
+    microbox.AddStat("temp_act", 20, 5000);
+#endif
 }
 
 void CalcMaxDiv()
@@ -178,7 +199,7 @@ void CalcMaxDiv()
         maxDiv = d;
 }
 
-void ADRead()
+void ADRead(uint8_t id)
 {
     Wire.requestFrom(0x78, 2);    // request 6 bytes from slave device #2
 
@@ -207,12 +228,6 @@ void ADRead()
 
 void loop()
 { 
-    if(millis() - lastADRead >= adIntervall)
-    {
-        ADRead();
-        lastADRead = millis();
-    }
-
     if(atuneMode)
     {
         if(aTune.Runtime() != 0)
@@ -224,7 +239,7 @@ void loop()
             Kd = aTune.GetKd();
             incuPID.SetTunings(Kp,Ki,Kd);
             incuPID.SetMode(AUTOMATIC);
-            Serial.println(F("Autotune finished"));
+            microbox.out.println(F("Autotune finished"));
         }
     }
     else
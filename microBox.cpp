@@ -8,22 +8,48 @@
 #include <microBox.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <util/atomic.h>
 
 microBox microbox;
 const prog_char fileDate[] PROGMEM = __DATE__;
 
-CMD_ENTRY microBox::Cmds[] =
+// MB_BUILTIN_CMDS counts these entries
+const BUILTIN_CMD microBox::builtinCmds[MB_BUILTIN_CMDS] PROGMEM =
 {
+    {"abort", microBox::TransAbortCB},
+    {"begin", microBox::TransBeginCB},
+    {"cachestat", microBox::CacheStatCB},
+#if MB_CAPTURE
+    {"capture", microBox::CaptureCB},
+#endif
     {"cat", microBox::CatCB},
     {"cd", microBox::ChangeDirCB},
+    {"commit", microBox::TransCommitCB},
+#if MB_CRON
+    {"cron", microBox::CronCB},
+#endif
     {"echo", microBox::EchoCB},
+#if MB_JOBS
+    {"jobs", microBox::JobsCB},
+    {"kill", microBox::KillCB},
+#endif
     {"loadpar", microBox::LoadParCB},
     {"ll", microBox::ListLongCB},
     {"ls", microBox::ListDirCB},
-    {"savepar", microBox::SaveParCB},
+    {"ps", microBox::PsCB},
+#if MB_RPC
+    {"rpc", microBox::RpcCB},
+#endif
+    {"savepar", NULL, microBox::SaveParCB},
+#if MB_SCRIPTS
+    {"script", microBox::ScriptCB},
+#endif
+#if MB_STATS
+    {"stats", microBox::StatsCB},
+#endif
+    {"time", microBox::TimeCB},
     {"watch", microBox::watchCB},
-    {"watchcsv", microBox::watchcsvCB},
-    {NULL, NULL}
+    {"watchcsv", microBox::watchcsvCB}
 };
 
 const char microBox::dirList[][5] PROGMEM =
@@ -31,13 +57,218 @@ const char microBox::dirList[][5] PROGMEM =
     "bin", "dev", "etc", "proc", "sbin", "var", "lib", "sys", "tmp", "usr", ""
 };
 
+const char microBox::procFiles[][8] PROGMEM =
+{
+#if MB_PROFILING
+    "cmds",
+#endif
+    "meminfo", "shell", ""
+};
+
+#ifdef __AVR__
+extern int __heap_start, *__brkval;
+#define STACK_PAINT 0xA5
+#endif
+
+microBoxOut::microBoxOut()
+{
+    bytesOut = 0;
+    flushes = 0;
+    holdMs = 0;
+    echo = false;
+#if MB_RPC
+    json = false;
+#endif
+    bufLen = 0;
+    held = false;
+    holdStart = 0;
+}
+
+size_t microBoxOut::write(uint8_t ch)
+{
+#if MB_RPC
+    if(json)
+        return WriteJson(ch);
+#endif
+    Put(&ch, 1);
+    return 1;
+}
+
+size_t microBoxOut::write(const uint8_t *buffer, size_t size)
+{
+    size_t i;
+
+#if MB_RPC
+    if(json)
+    {
+        for(i=0;i<size;i++)
+            WriteJson(buffer[i]);
+        return size;
+    }
+#endif
+    for(i=0;i<size;i+=MAX_OUT_BUF)
+        Put(buffer + i, (size - i > MAX_OUT_BUF) ? MAX_OUT_BUF : size - i);
+    return size;
+}
+
+// Output written with echo set may be held back by Drain() for up to
+// holdMs, so that fast typing goes out in one write. Any other output
+// releases it.
+void microBoxOut::Put(const uint8_t *pData, uint8_t len)
+{
+    if(bufLen + len > MAX_OUT_BUF)
+        Flush();
+    if(!echo)
+        held = false;
+    else if(bufLen == 0 && holdMs != 0)
+    {
+        held = true;
+        holdStart = millis();
+    }
+    memcpy(buf + bufLen, pData, len);
+    bufLen += len;
+    bytesOut += len;
+}
+
+void microBoxOut::Flush()
+{
+    held = false;
+    if(bufLen == 0)
+        return;
+    Serial.write(buf, bufLen);
+    bufLen = 0;
+    flushes++;
+}
+
+void microBoxOut::Drain()
+{
+    if(held && millis() - holdStart < holdMs)
+        return;
+    Flush();
+}
+
+#if MB_RPC
+// CR is dropped so println() ends up as a single "\n"
+size_t microBoxOut::WriteJson(uint8_t ch)
+{
+    uint8_t esc[6];
+    uint8_t len = 0;
+
+    if(ch == '\r')
+        return 1;
+    if(ch == '\n' || ch == '\t')
+    {
+        esc[len++] = '\\';
+        esc[len++] = (ch == '\n') ? 'n' : 't';
+    }
+    else if(ch == '"' || ch == '\\')
+    {
+        esc[len++] = '\\';
+        esc[len++] = ch;
+    }
+    else if(ch < 0x20 || ch >= 0x7F)
+    {
+        esc[len++] = '\\';
+        esc[len++] = 'u';
+        esc[len++] = '0';
+        esc[len++] = '0';
+        esc[len++] = "0123456789abcdef"[ch >> 4];
+        esc[len++] = "0123456789abcdef"[ch & 0x0F];
+    }
+    else
+        esc[len++] = ch;
+    Put(esc, len);
+    return 1;
+}
+#endif
+
 microBox::microBox()
 {
+    uint8_t i;
+
     bufPos = 0;
-    watchMode = false;
     csvMode = false;
     locEcho = false;
-    watchTimeout = 0;
+#if MB_RPC
+    rpcMode = false;
+    rpcFrame = false;
+    lineDropped = false;
+    deferredJobs = 0;
+    deferredCron = 0;
+#endif
+    cmdStatus = RC_OK;
+    fgJob = -1;
+    bgExec = false;
+    jobExec = false;
+    paramSeq = 0;
+    paramOrder = paramOrderBuf;
+    paramOrderSize = MAX_PARAMS;
+    paramCnt = 0;
+    transMode = false;
+    transCnt = 0;
+    transStrPos = 0;
+    memset(cacheEntries, 0, sizeof(cacheEntries));
+    memset(tasks, 0, sizeof(tasks));
+#if MB_CRON
+    memset(cronTasks, -1, sizeof(cronTasks));
+#endif
+    started = false;
+    userCmdCnt = 0;
+    for(i=0;i<MAX_JOBS;i++)
+        jobs[i].task = -1;
+    resCmd = -1;
+    resPrompt = false;
+    resBg = false;
+#if MB_SCRIPTS
+    memset(scripts, 0, sizeof(scripts));
+    scriptActive = false;
+#endif
+    chainNext = NULL;
+    chainOp = ';';
+    eeState = EE_IDLE;
+    eeSize = 0;
+    eeSeq = 0;
+#if MB_CAPTURE
+    capBuf = NULL;
+    capSize = 0;
+    capChannels = 0;
+    capRate = 1;
+    capTask = -1;
+    capTrigMode = CAP_TRIG_NONE;
+    capTrigLevel = 0;
+    capPre = 0;
+    capState = CAP_IDLE;
+    capWr = 0;
+    capCount = 0;
+    capTrigPos = -1;
+#endif
+#if MB_STATS
+    memset(stats, 0, sizeof(stats));
+    statBuf = NULL;
+    statBufSize = 0;
+    statBufUsed = 0;
+#endif
+    parserStart = 0;
+    parserBudget = 0;
+    taskNext = 0;
+    taLen = 0;
+    taPos = 0;
+    budgetOverruns = 0;
+    getFuncCalls = 0;
+    setFuncCalls = 0;
+    cacheHits = 0;
+    cacheMisses = 0;
+#if MB_PROFILING
+    parserCalls = 0;
+    parserTotalUs = 0;
+    parserMaxUs = 0;
+    bytesIn = 0;
+    charsDropped = 0;
+    telnetRecv = 0;
+    telnetSent = 0;
+    memset(cmdCalls, 0, sizeof(cmdCalls));
+    memset(cmdMaxUs, 0, sizeof(cmdMaxUs));
+#endif
     escSeq = 0;
     historyWrPos = 0;
     historyBufSize = 0;
@@ -49,8 +280,12 @@ microBox::~microBox()
 {
 }
 
-void microBox::begin(PARAM_ENTRY *pParams, const char* hostName, bool localEcho, char *histBuf, int historySize)
+// Returns false if the table has more parameters than the index holds,
+// the shell then only sees the first ones.
+bool microBox::begin(const PARAM_ENTRY *pParams, const char* hostName, bool localEcho, char *histBuf, int historySize)
 {
+    bool fits;
+
     historyBuf = histBuf;
     if(historyBuf != NULL && historySize != 0)
     {
@@ -62,30 +297,127 @@ void microBox::begin(PARAM_ENTRY *pParams, const char* hostName, bool localEcho,
     locEcho = localEcho;
     Params = pParams;
     machName = hostName;
-    ParmPtr[0] = NULL;
+    fits = BuildParamIndex();
+    if(ParamImageSize() > (int)PARAM_EE_END)
+        out.println(F("microBox: Parameters overlap EEPROM scripts or cron jobs"));
+    ParmPtr[1] = NULL;
     strcpy(currentDir, "/");
-    ShowPrompt();
+    PaintStack();
+    return fits;
+}
+
+// Index buffer for PARAM_ENTRY tables with more than MAX_PARAMS entries,
+// one byte per parameter, up to 255. Call it before begin().
+void microBox::SetParamIndex(uint8_t *pIndex, uint8_t size)
+{
+    paramOrder = pIndex;
+    paramOrderSize = size;
 }
 
 bool microBox::AddCommand(const char *cmdName, void (*cmdFunc)(char **param, uint8_t parCnt))
 {
-    uint8_t idx = 0;
+    return AddCmdEntry(cmdName, cmdFunc, NULL);
+}
+
+// Resumable command: returns CMD_BUSY to be called again from the next
+// cmdParser() run, CMD_DONE when finished.
+bool microBox::AddCommand(const char *cmdName, uint8_t (*resFunc)(char **param, uint8_t parCnt, CMD_STATE *pState))
+{
+    return AddCmdEntry(cmdName, NULL, resFunc);
+}
 
-    while((Cmds[idx].cmdFunc != NULL) && (idx < (MAX_CMD_NUM-1)))
+bool microBox::AddCmdEntry(const char *cmdName, void (*cmdFunc)(char **param, uint8_t parCnt),
+                           uint8_t (*resFunc)(char **param, uint8_t parCnt, CMD_STATE *pState))
+{
+    if(userCmdCnt < MAX_USER_CMDS)
     {
-        idx++;
+        userCmdList[userCmdCnt].cmdName = cmdName;
+        userCmdList[userCmdCnt].cmdFunc = cmdFunc;
+        userCmdList[userCmdCnt].resFunc = resFunc;
+        userCmdCnt++;
+        return true;
     }
-    if(idx < (MAX_CMD_NUM-1))
+    return false;
+}
+
+// Copy of a table entry, read from flash with MB_PARAMS_PROGMEM
+PARAM_ENTRY microBox::Param(uint8_t idx)
+{
+#if MB_PARAMS_PROGMEM
+    PARAM_ENTRY entry;
+
+    memcpy_P(&entry, &Params[idx], sizeof(entry));
+    return entry;
+#else
+    return Params[idx];
+#endif
+}
+
+// Commands are numbered builtins first, then user commands. Builtin
+// names are copied from flash to pBuf (MAX_CMD_NAME bytes).
+const char *microBox::CmdName(uint8_t idx, char *pBuf)
+{
+    if(idx >= MB_BUILTIN_CMDS)
+        return userCmdList[idx - MB_BUILTIN_CMDS].cmdName;
+    strcpy_P(pBuf, builtinCmds[idx].cmdName);
+    return pBuf;
+}
+
+bool microBox::IsResCmd(uint8_t idx)
+{
+    if(idx >= MB_BUILTIN_CMDS)
+        return userCmdList[idx - MB_BUILTIN_CMDS].resFunc != NULL;
+    return pgm_read_ptr(&builtinCmds[idx].resFunc) != NULL;
+}
+
+void microBox::CallCmd(uint8_t idx, char **pParam, uint8_t parCnt)
+{
+    void (*cmdFunc)(char **param, uint8_t parCnt);
+
+    if(idx >= MB_BUILTIN_CMDS)
+        cmdFunc = userCmdList[idx - MB_BUILTIN_CMDS].cmdFunc;
+    else
+        cmdFunc = (void (*)(char**, uint8_t))pgm_read_ptr(&builtinCmds[idx].cmdFunc);
+    (*cmdFunc)(pParam, parCnt);
+}
+
+uint8_t microBox::CallResCmd(uint8_t idx, char **pParam, uint8_t parCnt)
+{
+    uint8_t (*resFunc)(char **param, uint8_t parCnt, CMD_STATE *pState);
+
+    if(idx >= MB_BUILTIN_CMDS)
+        resFunc = userCmdList[idx - MB_BUILTIN_CMDS].resFunc;
+    else
+        resFunc = (uint8_t (*)(char**, uint8_t, CMD_STATE*))pgm_read_ptr(&builtinCmds[idx].resFunc);
+    return (*resFunc)(pParam, parCnt, &resState);
+}
+
+// Echo of typed characters is kept back for up to ms milliseconds to
+// gather it into fewer writes, e.g. for telnet over TCP. 0 writes it at
+// the end of each cmdParser() run.
+void microBox::SetOutputHold(uint16_t ms)
+{
+    out.holdMs = ms;
+}
+
+#if MB_SCRIPTS
+// script is a PROGMEM string, e.g. AddScript("setup", PSTR("cd /dev; cat -k *"))
+bool microBox::AddScript(const char *name, const char *script)
+{
+    uint8_t i;
+
+    for(i=0;i<MAX_SCRIPTS;i++)
     {
-        Cmds[idx].cmdName = cmdName;
-        Cmds[idx].cmdFunc = cmdFunc;
-        idx++;
-        Cmds[idx].cmdFunc = NULL;
-        Cmds[idx].cmdName = NULL;
-        return true;
+        if(scripts[i].name == NULL)
+        {
+            scripts[i].name = name;
+            scripts[i].script = script;
+            return true;
+        }
     }
     return false;
 }
+#endif
 
 bool microBox::isTimeout(unsigned long *lastTime, unsigned long intervall)
 {
@@ -100,160 +432,844 @@ bool microBox::isTimeout(unsigned long *lastTime, unsigned long intervall)
     return false;
 }
 
-void microBox::ShowPrompt()
+int8_t microBox::AddTask(void (*taskFunc)(uint8_t id), unsigned long period, uint8_t id)
 {
-    Serial.print(F("root@"));
-    Serial.print(machName);
-    Serial.print(F(":"));
-    Serial.print(currentDir);
-    Serial.print(F(">"));
+    int8_t i;
+
+    for(i=0;i<MAX_TASKS;i++)
+    {
+        if(tasks[i].taskFunc == NULL)
+        {
+            tasks[i].taskFunc = taskFunc;
+            tasks[i].period = period;
+            tasks[i].deadline = millis() + period;
+            tasks[i].overruns = 0;
+            tasks[i].id = id;
+            return i;
+        }
+    }
+    return -1;
 }
 
-uint8_t microBox::ParseCmdParams(char *pParam)
+void microBox::RemoveTask(int8_t task)
 {
-    uint8_t idx = 0;
+    if(task >= 0 && task < MAX_TASKS)
+        tasks[task].taskFunc = NULL;
+}
 
-    ParmPtr[idx] = pParam;
-    if(pParam != NULL)
+void microBox::SetTaskPeriod(int8_t task, unsigned long period)
+{
+    if(task >= 0 && task < MAX_TASKS)
+    {
+        tasks[task].period = period;
+        tasks[task].deadline = millis() + period;
+    }
+}
+
+uint16_t microBox::GetTaskOverruns(int8_t task)
+{
+    if(task >= 0 && task < MAX_TASKS)
+        return tasks[task].overruns;
+    return 0;
+}
+
+// Deadlines advance by whole periods so late calls do not shift the
+// phase; every period skipped because of a late call counts as overrun.
+// Tasks skipped because the parser budget ran out are first in line on
+// the next run.
+void microBox::RunTasks()
+{
+    uint8_t i, n;
+    unsigned long m;
+    unsigned long missed;
+
+    for(n=0;n<MAX_TASKS;n++)
     {
-        idx++;
-        while((pParam = strchr(pParam, ' ')) != NULL)
+        i = (taskNext + n) % MAX_TASKS;
+        if(tasks[i].taskFunc == NULL)
+            continue;
+        if(!BudgetLeft())
         {
-            pParam[0] = 0;
-            pParam++;
-            ParmPtr[idx++] = pParam;
+            taskNext = i;
+            return;
+        }
+        m = millis();
+        if((long)(m - tasks[i].deadline) >= 0)
+        {
+            if(tasks[i].period != 0)
+            {
+                missed = (m - tasks[i].deadline) / tasks[i].period;
+                tasks[i].deadline += (missed + 1) * tasks[i].period;
+                tasks[i].overruns += missed;
+            }
+            (*tasks[i].taskFunc)(tasks[i].id);
         }
     }
-    return idx;
+}
+
+// Returns ms until the next task is due, 0 if one is overdue and NO_TASK
+// if nothing is scheduled.
+unsigned long microBox::TimeToNextTask()
+{
+    uint8_t i;
+    unsigned long m;
+    unsigned long next = NO_TASK;
+
+    m = millis();
+    for(i=0;i<MAX_TASKS;i++)
+    {
+        if(tasks[i].taskFunc == NULL)
+            continue;
+        if((long)(tasks[i].deadline - m) <= 0)
+            return 0;
+        if(tasks[i].deadline - m < next)
+            next = tasks[i].deadline - m;
+    }
+    return next;
+}
+
+#if MB_CAPTURE
+// The capture ring buffer is provided by the sketch, size in values
+void microBox::SetCaptureBuffer(PARAM_VALUE *pBuf, uint16_t size)
+{
+    capState = CAP_IDLE;
+    capBuf = pBuf;
+    capSize = size;
+    capCount = 0;
+}
+
+// Timer hook for capture rate 0, may be called from an ISR. getFunc is
+// not called here, captured parameters must be updated by the sketch.
+void microBox::CaptureTick()
+{
+    if(capRate == 0)
+        CaptureSample();
+}
+#endif
+
+#if MB_STATS
+// Window samples of all statistics are kept in this sketch provided buffer
+void microBox::SetStatBuffer(double *pBuf, uint16_t size)
+{
+    statBuf = pBuf;
+    statBufSize = size;
+    statBufUsed = 0;
+}
+
+bool microBox::AddStat(const char *paramName, uint8_t window, unsigned long period)
+{
+    int16_t idx;
+
+    idx = FindParam(paramName, strlen(paramName));
+    if(idx == -1)
+        return false;
+    return AddStatIdx(idx, window, period);
+}
+#endif
+
+// Writers updating several related parameters (e.g. from an ISR) bracket
+// the update with ParamWriteBegin/End so snapshots never see half of it.
+void microBox::ParamWriteBegin()
+{
+    paramSeq++;
+}
+
+void microBox::ParamWriteEnd()
+{
+    paramSeq++;
+}
+
+// Seqlock-style snapshot: every value is copied in its own short critical
+// section, the whole set is retried if a writer ran in between.
+bool microBox::SnapshotParams(const uint8_t *pIdx, PARAM_VALUE *pVals, uint8_t cnt)
+{
+    uint8_t i;
+    uint8_t seq;
+    uint8_t retry = 0;
+
+    for(i=0;i<cnt;i++)
+        GetParam(pIdx[i]);
+    do
+    {
+        seq = paramSeq;
+        for(i=0;i<cnt;i++)
+            CopyParam(pIdx[i], &pVals[i]);
+        if(!(seq & 1) && seq == paramSeq)
+            return true;
+        retry++;
+    }
+    while(retry < MAX_SNAPSHOT_RETRIES);
+    return false;
+}
+
+// In rpc mode the prompt is replaced by the end of the reply
+void microBox::ShowPrompt()
+{
+#if MB_RPC
+    if(rpcFrame)
+        RpcEnd();
+    if(rpcMode)
+        return;
+#endif
+    out.print(F("root@"));
+    out.print(machName);
+    out.print(F(":"));
+    out.print(currentDir);
+    out.print(F(">"));
 }
 
 void microBox::ExecCommand()
 {
-    bool found = false;
-    Serial.println();
+    out.println();
     if(bufPos > 0)
     {
-        uint8_t i=0;
-        uint8_t dstlen;
-        uint8_t srclen;
-        char *pParam;
-
         cmdBuf[bufPos] = 0;
-        pParam = strchr(cmdBuf, ' ');
-        if(pParam != NULL)
-        {
-            pParam++;
-            srclen = pParam - cmdBuf - 1;
-        }
-        else
-            srclen = bufPos;
-
         AddToHistory(cmdBuf);
         historyCursorPos = -1;
+        bufPos = 0;
 
-        while(Cmds[i].cmdName != NULL && found == false)
-        {
-            dstlen = strlen(Cmds[i].cmdName);
-            if(dstlen == srclen)
-            {
-                if(strncmp(cmdBuf, Cmds[i].cmdName, dstlen) == 0)
-                {
-                    (*Cmds[i].cmdFunc)(ParmPtr, ParseCmdParams(pParam));
-                    found = true;
-                    bufPos = 0;
-                    ShowPrompt();
-                }
-            }
-            i++;
-        }
-        if(!found)
+        RunChain(cmdBuf);
+        if(resCmd != -1 && !resBg)
         {
-            bufPos = 0;
-            ErrorDir(F("/bin/sh"));
-            ShowPrompt();
+            resPrompt = true;
+            return;
         }
     }
-    else
-        ShowPrompt();
+    ShowPrompt();
 }
 
-void microBox::cmdParser()
+#if MB_RPC
+// Machine mode: every line is "<id> <command line>" and is answered by
+// one JSON line {"id":<id>,"out":"<output>","rc":<status>}. Requests are
+// answered in order, so a client may send many without waiting. Only
+// output printed to out ends up in "out", a user command writing to
+// Serial itself puts its text in front of the reply.
+void microBox::ExecRpc()
 {
-    if(watchMode)
+    char *pLine;
+
+    cmdBuf[bufPos] = 0;
+    bufPos = 0;
+    if(cmdBuf[0] == 0 && !lineDropped)
+        return;
+
+    // the id is echoed as JSON number, so no leading zeros
+    pLine = cmdBuf + strspn_P(cmdBuf, PSTR("0123456789"));
+    if(pLine == cmdBuf || (*pLine != ' ' && *pLine != 0) || (cmdBuf[0] == '0' && pLine - cmdBuf > 1))
     {
-        if(Serial.available())
-        {
-            watchMode = false;
-            csvMode = false;
-        }
+        RpcBegin(F("id"), NULL);
+        cmdStatus = RC_BADREQ;
+    }
+    else
+    {
+        if(*pLine != 0)
+            *pLine++ = 0;
+        RpcBegin(F("id"), cmdBuf);
+        if(lineDropped)
+            cmdStatus = RC_BADREQ;
         else
-        {
-            if(isTimeout(&watchTimeout, 500))
-                Cat_int(cmdBuf);
-
-            return;
-        }
+            RunChain(pLine);
     }
-    while(Serial.available())
+    lineDropped = false;
+    if(resCmd != -1 && !resBg)
     {
-        uint8_t ch;
-        ch = Serial.read();
-        if(ch == TELNET_IAC || stateTelnet != TELNET_STATE_NORMAL)
-        {
-            handleTelnet(ch);
-            continue;
-        }
+        resPrompt = true;
+        return;
+    }
+    ShowPrompt();
+}
 
-        if(HandleEscSeq(ch))
-            continue;
+void microBox::RpcBegin(const __FlashStringHelper *pKey, const char *pId)
+{
+    out.print(F("{\""));
+    out.print(pKey);
+    out.print(F("\":"));
+    if(pId != NULL)
+        out.print(pId);
+    else
+        out.print(F("null"));
+    out.print(F(",\"out\":\""));
+    out.json = true;
+    rpcFrame = true;
+}
 
-        if(ch == 0x7F || ch == 0x08)
+void microBox::RpcEnd()
+{
+    out.json = false;
+    rpcFrame = false;
+    out.print(F("\",\"rc\":"));
+    out.print(cmdStatus);
+    out.println(F("}"));
+}
+#endif
+
+// Runs "cmd1; cmd2 && cmd3 || cmd4" in place, every part goes straight
+// to Dispatch. Script names are replaced by the script text. A foreground
+// resumable command pauses the chain, ResumeCommand continues it.
+bool microBox::RunChain(char *pLine, bool background, char op)
+{
+    char *pNext;
+    char nextOp;
+    bool found = true;
+    bool bg;
+    uint8_t tokCnt;
+#if MB_SCRIPTS
+    bool inScript;
+    uint8_t nest = 0;
+    int8_t ret;
+
+    inScript = (pLine >= scriptBuf && pLine < scriptBuf + sizeof(scriptBuf));
+#endif
+    while(pLine != NULL)
+    {
+        tokCnt = Tokenize(pLine, &pNext, &nextOp, &bg);
+#if !MB_JOBS
+        // without job control '&' runs in the foreground
+        bg = false;
+#endif
+        if(tokCnt != 0 && (op == ';' || (op == '&' && cmdStatus == RC_OK) ||
+                           (op == '|' && cmdStatus != RC_OK)))
         {
-            if(bufPos > 0)
+            if(tokCnt > MAX_CMD_PARAMS + 1)
             {
-                bufPos--;
-                cmdBuf[bufPos] = 0;
-                Serial.write(ch);
-                Serial.print(F(" \x1B[1D"));
+                PrintError(F("sh: Too many arguments"));
             }
-            else
+            else if(!Dispatch(tokCnt, background || bg))
             {
-                Serial.print(F("\a"));
+#if MB_SCRIPTS
+                // a paused chain may still run from scriptBuf
+                if(scriptActive && !inScript)
+                    ret = -2;
+                else
+                    ret = LoadScript(ParmPtr[0], ParmLen[0], pNext, nextOp);
+                if(ret == 1 && nest < MAX_SCRIPT_NEST)
+                {
+                    nest++;
+                    inScript = true;
+                    scriptActive = true;
+                    pLine = scriptBuf;
+                    op = ';';
+                    continue;
+                }
+                if(ret == -1)
+                    ErrorDir(F("/bin/sh"));
+                else if(ret == -2)
+                    PrintError(F("sh: Script busy"));
+                else if(ret == 1)
+                    PrintError(F("sh: Scripts nested too deep"));
+                cmdStatus = (ret == -1) ? RC_NOCMD : RC_ERROR;
+                found = false;
+                if(ret != -1)
+                    break;
+#else
+                ErrorDir(F("/bin/sh"));
+                cmdStatus = RC_NOCMD;
+                found = false;
+#endif
+            }
+            // only the foreground chain waits for its resumable command,
+            // job and cron chains run on
+            if(!background && resCmd != -1 && !resBg)
+            {
+                chainNext = pNext;
+                chainOp = nextOp;
+                return found;
             }
         }
-        else if(ch == '\t')
-        {
-            HandleTab();
-        }
-        else if(ch != '\r' && bufPos < (MAX_CMD_BUF_SIZE-1))
+        pLine = pNext;
+        op = nextOp;
+    }
+#if MB_SCRIPTS
+    if(inScript)
+        scriptActive = false;
+#endif
+    return found;
+}
+
+// Splits one command of a chain into ParmPtr/ParmLen in a single pass.
+// Tokens are separated by any number of blanks, '...' and "..." group,
+// a backslash escapes the next char. Quotes and backslashes are removed
+// in place. Stops behind an unquoted ';', "&&" or "||" and returns the
+// rest of the line in *ppNext. A trailing '&' sets *pBg. Returns the
+// token count, more than MAX_CMD_PARAMS+1 if there are too many.
+uint8_t microBox::Tokenize(char *pLine, char **ppNext, char *pOp, bool *pBg)
+{
+    char *pWr = pLine;
+    char *pAhead;
+    char quote = 0;
+    char ch;
+    uint8_t cnt = 0;
+    bool inTok = false;
+
+    *ppNext = NULL;
+    *pOp = ';';
+    *pBg = false;
+    while((ch = *pLine) != 0)
+    {
+        if(quote == 0)
         {
-            if(ch != '\n')
+            if(ch == ' ' || ch == '\t')
             {
-                if(locEcho)
-                    Serial.write(ch);
-                cmdBuf[bufPos++] = ch;
-                cmdBuf[bufPos] = 0;
+                if(inTok)
+                {
+                    TokenEnd(cnt++, pWr++);
+                    inTok = false;
+                }
+                pLine++;
+                continue;
+            }
+            if(ch == ';' || ((ch == '&' || ch == '|') && pLine[1] == ch))
+            {
+                *pOp = ch;
+                *ppNext = pLine + ((ch == ';') ? 1 : 2);
+                break;
+            }
+            if(ch == '&')
+            {
+                pAhead = pLine + 1;
+                while(*pAhead == ' ' || *pAhead == '\t')
+                    pAhead++;
+                if(*pAhead == 0 || *pAhead == ';' || ((*pAhead == '&' || *pAhead == '|') && pAhead[1] == *pAhead))
+                {
+                    *pBg = true;
+                    pLine = pAhead;
+                    continue;
+                }
             }
         }
+        if(!inTok)
+        {
+            if(cnt < MAX_CMD_PARAMS + 1)
+                ParmPtr[cnt] = pWr;
+            inTok = true;
+        }
+        pLine++;
+        if(quote == 0 && (ch == '"' || ch == '\''))
+            quote = ch;
+        else if(quote != 0 && ch == quote)
+            quote = 0;
         else
         {
-            ExecCommand();
+            if(ch == '\\' && quote != '\'' && *pLine != 0)
+                ch = *pLine++;
+            if(cnt < MAX_CMD_PARAMS + 1)
+                *pWr = ch;
+            pWr++;
         }
     }
+    if(inTok)
+        TokenEnd(cnt++, pWr);
+    if(cnt < MAX_CMD_PARAMS + 2)
+        ParmPtr[cnt] = NULL;
+    return cnt;
 }
 
-bool microBox::HandleEscSeq(unsigned char ch)
+void microBox::TokenEnd(uint8_t tok, char *pEnd)
 {
-    bool ret = false;
-
-    if(ch == 27)
+    if(tok < MAX_CMD_PARAMS + 1)
     {
-        escSeq = ESC_STATE_START;
-        ret = true;
+        ParmLen[tok] = pEnd - ParmPtr[tok];
+        *pEnd = 0;
     }
-    else if(escSeq == ESC_STATE_START)
-    {
-        if(ch == 0x5B)
+}
+
+// Length of parameter n of the running command, valid on its first call
+uint8_t microBox::ArgLen(uint8_t n)
+{
+    return ParmLen[n + 1];
+}
+
+#if MB_SCRIPTS
+// Copies the script named pName to scriptBuf and
+// appends the rest of the chain, so "script && cmd" sees the status of
+// the script's last command. Returns 1 if loaded, -1 if there is no such
+// script and 0 if it does not fit.
+int8_t microBox::LoadScript(char *pName, uint8_t len, char *pRest, char restOp)
+{
+    uint8_t i;
+    uint8_t bodyLen = 0;
+    uint8_t restLen = 0;
+    int8_t ee = -1;
+    const char *pFlash = NULL;
+
+    for(i=0;i<MAX_SCRIPTS && scripts[i].name != NULL;i++)
+    {
+        if(strncmp(scripts[i].name, pName, len) == 0 && scripts[i].name[len] == 0)
+            pFlash = scripts[i].script;
+    }
+    if(pFlash != NULL)
+        bodyLen = strlen_P(pFlash);
+    else
+    {
+        ee = FindEEScript(pName, len);
+        if(ee == -1)
+            return -1;
+        while(bodyLen < MAX_SCRIPT_LEN && eeprom_read_byte(EE_PTR(SCRIPT_EE(ee) + offsetof(EE_SCRIPT, script) + bodyLen)) != 0)
+            bodyLen++;
+    }
+    if(pRest != NULL)
+        restLen = strlen(pRest) + 4;
+    if(bodyLen + restLen >= sizeof(scriptBuf))
+    {
+        PrintError(F("sh: Script too long"));
+        return 0;
+    }
+    if(pRest != NULL)
+    {
+        memmove(scriptBuf + bodyLen + 4, pRest, restLen - 3);
+        scriptBuf[bodyLen] = ' ';
+        scriptBuf[bodyLen+1] = restOp;
+        scriptBuf[bodyLen+2] = (restOp == ';') ? ' ' : restOp;
+        scriptBuf[bodyLen+3] = ' ';
+    }
+    else
+        scriptBuf[bodyLen] = 0;
+    if(pFlash != NULL)
+        memcpy_P(scriptBuf, pFlash, bodyLen);
+    else
+        eeprom_read_block(scriptBuf, EE_PTR(SCRIPT_EE(ee) + offsetof(EE_SCRIPT, script)), bodyLen);
+    return 1;
+}
+
+int8_t microBox::FindEEScript(const char *pName, uint8_t len)
+{
+    uint8_t i;
+    char name[MAX_SCRIPT_NAME];
+
+    if(len >= MAX_SCRIPT_NAME)
+        return -1;
+    for(i=0;i<MAX_EE_SCRIPTS;i++)
+    {
+        eeprom_read_block(name, EE_PTR(SCRIPT_EE(i) + offsetof(EE_SCRIPT, name)), MAX_SCRIPT_NAME);
+        if(strncmp(name, pName, len) == 0 && name[len] == 0)
+            return i;
+    }
+    return -1;
+}
+#endif
+
+// Runs the command tokenized into ParmPtr/ParmLen, ParmPtr[0] is the
+// command name.
+bool microBox::Dispatch(uint8_t tokCnt, bool background)
+{
+    uint8_t i;
+    char name[MAX_CMD_NAME];
+
+    bgExec = background;
+    for(i=0;i<MB_BUILTIN_CMDS+userCmdCnt;i++)
+    {
+        if(strcmp(ParmPtr[0], CmdName(i, name)) != 0)
+            continue;
+        cmdStatus = RC_OK;
+        // user commands may print to Serial directly
+        if(i >= MB_BUILTIN_CMDS)
+            out.Flush();
+        if(!IsResCmd(i))
+        {
+#if MB_PROFILING
+            unsigned long t = micros();
+            cmdCalls[i]++;
+            CallCmd(i, ParmPtr + 1, tokCnt - 1);
+            t = micros() - t;
+            if(t > cmdMaxUs[i])
+                cmdMaxUs[i] = t;
+#else
+            CallCmd(i, ParmPtr + 1, tokCnt - 1);
+#endif
+        }
+        else if(resCmd == -1)
+        {
+#if MB_PROFILING
+            cmdCalls[i]++;
+#endif
+            resCmd = i;
+            resPrompt = false;
+            resBg = background;
+            memset(&resState, 0, sizeof(resState));
+            ResumeCommand(ParmPtr + 1, tokCnt - 1);
+            if(resCmd != -1 && resBg)
+            {
+                out.print(F("["));
+                out.print(MAX_JOBS);
+                out.println(F("]"));
+            }
+        }
+        else
+        {
+            out.print(name);
+            PrintError(F(": Busy"));
+        }
+        return true;
+    }
+    cmdStatus = RC_NOCMD;
+    return false;
+}
+
+void microBox::ResumeCommand(char **pParam, uint8_t parCnt)
+{
+    uint8_t ret;
+    char *pLine;
+    bool prompt;
+
+    if(resCmd >= MB_BUILTIN_CMDS)
+        out.Flush();
+#if MB_PROFILING
+    unsigned long t = micros();
+    ret = CallResCmd(resCmd, pParam, parCnt);
+    t = micros() - t;
+    if(t > cmdMaxUs[resCmd])
+        cmdMaxUs[resCmd] = t;
+#else
+    ret = CallResCmd(resCmd, pParam, parCnt);
+#endif
+    resState.calls++;
+    if(ret == CMD_DONE || resState.cancel)
+    {
+        resCmd = -1;
+        if(resState.cancel)
+        {
+            cmdStatus = RC_ERROR;
+            chainNext = NULL;
+#if MB_SCRIPTS
+            scriptActive = false;
+#endif
+        }
+        if(chainNext != NULL)
+        {
+            prompt = resPrompt;
+            pLine = chainNext;
+            chainNext = NULL;
+            RunChain(pLine, false, chainOp);
+            resPrompt = prompt;
+            if(resCmd != -1 && !resBg)
+                return;
+        }
+        if(resPrompt)
+            ShowPrompt();
+    }
+}
+
+// With a budget the parser stops between units of work (input chars,
+// tasks, EEPROM bytes) once budgetUs is spent, the next call goes on
+// from there. A single command still runs to its end, long running
+// commands should be resumable.
+void microBox::cmdParser(unsigned long budgetUs)
+{
+    parserStart = micros();
+    parserBudget = budgetUs;
+    ParserRun();
+    // a spent budget leaves the output for the next pass, a full buffer
+    // is written out anyway
+    if(BudgetLeft())
+        out.Drain();
+    parserBudget = 0;
+    unsigned long t = micros() - parserStart;
+    if(budgetUs != 0 && t > budgetUs)
+        budgetOverruns++;
+#if MB_PROFILING
+    parserCalls++;
+    parserTotalUs += t;
+    if(t > parserMaxUs)
+        parserMaxUs = t;
+#endif
+}
+
+bool microBox::BudgetLeft()
+{
+    return parserBudget == 0 || micros() - parserStart < parserBudget;
+}
+
+// Moves input typed during a foreground command to typeAhead, so a
+// Ctrl-C behind other keys still cancels it. Ctrl-C drops the keys typed
+// before it. Telnet negotiation is handled right away. When typeAhead
+// is full the rest stays in the Serial buffer.
+void microBox::ReadAhead()
+{
+    uint8_t ch;
+
+    if(taPos == taLen)
+        taPos = taLen = 0;
+    while(Serial.available() && taLen < MAX_TYPEAHEAD)
+    {
+        ch = Serial.read();
+#if MB_PROFILING
+        bytesIn++;
+#endif
+        if(ch == TELNET_IAC || stateTelnet != TELNET_STATE_NORMAL)
+            handleTelnet(ch);
+        else if(ch == CTRL_C)
+        {
+            taPos = taLen = 0;
+            out.println(F("^C"));
+            resState.cancel = true;
+            return;
+        }
+        else
+            typeAhead[taLen++] = ch;
+    }
+}
+
+bool microBox::InputAvailable()
+{
+    return taPos < taLen || Serial.available();
+}
+
+// bytes from typeAhead are counted in bytesIn when read ahead
+uint8_t microBox::ReadInput()
+{
+    if(taPos < taLen)
+        return typeAhead[taPos++];
+#if MB_PROFILING
+    bytesIn++;
+#endif
+    return Serial.read();
+}
+
+void microBox::ParserRun()
+{
+    // commands and scripts are added after begin(), the boot jobs and
+    // the first prompt wait for them
+    if(!started)
+    {
+        started = true;
+#if MB_CRON
+        LoadCron();
+#endif
+        ShowPrompt();
+    }
+    // any key stops a foreground watch, a Ctrl-C is used up by that
+    if(fgJob != -1 && InputAvailable())
+    {
+        KillJob(fgJob);
+        if(taPos == taLen && Serial.peek() == CTRL_C)
+        {
+            Serial.read();
+            out.println(F("^C"));
+        }
+    }
+
+    EeWriterTick();
+    RunTasks();
+#if MB_RPC
+    RunDeferred();
+#endif
+    if(!BudgetLeft())
+        return;
+
+    // input stays queued while a foreground resumable command runs,
+    // except Ctrl-C. A background one runs on beside a foreground watch.
+    if(resCmd != -1)
+    {
+        if(!resBg)
+            ReadAhead();
+        ResumeCommand(NULL, 0);
+        if(resCmd != -1 && !resBg)
+            return;
+    }
+    if(fgJob != -1)
+        return;
+
+    while(InputAvailable() && BudgetLeft())
+    {
+        uint8_t ch;
+        ch = ReadInput();
+        if(ch == TELNET_IAC || stateTelnet != TELNET_STATE_NORMAL)
+        {
+            handleTelnet(ch);
+            continue;
+        }
+        // telnet clients send CR NUL for the enter key
+        if(ch == 0)
+            continue;
+
+#if MB_RPC
+        // no echo, editing or history for machine clients
+        if(rpcMode)
+        {
+            if(ch == '\r' || ch == '\n')
+            {
+                ExecRpc();
+                if(resCmd != -1 && !resBg)
+                    break;
+            }
+            else if(bufPos < (MAX_CMD_BUF_SIZE-1))
+                cmdBuf[bufPos++] = ch;
+            else
+            {
+#if MB_PROFILING
+                charsDropped++;
+#endif
+                lineDropped = true;
+            }
+            continue;
+        }
+#endif
+
+        if(HandleEscSeq(ch))
+            continue;
+
+        if(ch == 0x7F || ch == 0x08)
+        {
+            if(bufPos > 0)
+            {
+                bufPos--;
+                cmdBuf[bufPos] = 0;
+                out.echo = true;
+                out.write(ch);
+                out.print(F(" \x1B[1D"));
+                out.echo = false;
+            }
+            else
+            {
+                out.print(F("\a"));
+            }
+        }
+        else if(ch == '\t')
+        {
+            HandleTab();
+        }
+        else if(ch == '\r')
+        {
+            ExecCommand();
+            if(resCmd != -1 && !resBg)
+                break;
+        }
+        else if(ch != '\n')
+        {
+            if(bufPos < (MAX_CMD_BUF_SIZE-1))
+            {
+                if(locEcho)
+                {
+                    out.echo = true;
+                    out.write(ch);
+                    out.echo = false;
+                }
+                cmdBuf[bufPos++] = ch;
+                cmdBuf[bufPos] = 0;
+            }
+            else
+            {
+#if MB_PROFILING
+                charsDropped++;
+#endif
+                out.print(F("\a"));
+            }
+        }
+    }
+}
+
+bool microBox::HandleEscSeq(unsigned char ch)
+{
+    bool ret = false;
+
+    if(ch == 27)
+    {
+        escSeq = ESC_STATE_START;
+        ret = true;
+    }
+    else if(escSeq == ESC_STATE_START)
+    {
+        if(ch == 0x5B)
         {
             escSeq = ESC_STATE_CODE;
             ret = true;
@@ -289,16 +1305,18 @@ uint8_t microBox::ParCmp(uint8_t idx1, uint8_t idx2, bool cmd)
 
     const char *pName1;
     const char *pName2;
+    char name1[MAX_CMD_NAME];
+    char name2[MAX_CMD_NAME];
 
     if(cmd)
     {
-        pName1 = Cmds[idx1].cmdName;
-        pName2 = Cmds[idx2].cmdName;
+        pName1 = CmdName(idx1, name1);
+        pName2 = CmdName(idx2, name2);
     }
     else
     {
-        pName1 = Params[idx1].paramName;
-        pName2 = Params[idx2].paramName;
+        pName1 = Param(idx1).paramName;
+        pName2 = Param(idx2).paramName;
     }
 
     while(pName1[i] != 0 && pName2[i] != 0)
@@ -312,9 +1330,11 @@ uint8_t microBox::ParCmp(uint8_t idx1, uint8_t idx2, bool cmd)
 
 int8_t microBox::GetCmdIdx(char* pCmd, int8_t startIdx)
 {
-    while(Cmds[startIdx].cmdName != NULL)
+    char name[MAX_CMD_NAME];
+
+    while(startIdx < MB_BUILTIN_CMDS+userCmdCnt)
     {
-        if(strncmp(Cmds[startIdx].cmdName, pCmd, strlen(pCmd)) == 0)
+        if(strncmp(CmdName(startIdx, name), pCmd, strlen(pCmd)) == 0)
         {
             return startIdx;
         }
@@ -329,6 +1349,7 @@ void microBox::HandleTab()
     char *pParam = NULL;
     uint8_t i, len = 0;
     uint8_t parlen, matchlen, inlen;
+    char name[MAX_CMD_NAME];
 
     for(i=0;i<bufPos;i++)
     {
@@ -338,35 +1359,8 @@ void microBox::HandleTab()
     if(pParam != NULL)
     {
         pParam++;
-        if(*pParam != 0)
-        {
-            idx = GetParamIdx(pParam, true, 0);
-            if(idx >= 0)
-            {
-                parlen = strlen(Params[idx].paramName);
-                matchlen = parlen;
-                idx2=idx;
-                while((idx2=GetParamIdx(pParam, true, idx2+1))!= -1)
-                {
-                    matchlen = ParCmp(idx, idx2);
-                    if(matchlen < parlen)
-                        parlen = matchlen;
-                }
-                pParam = GetFile(pParam);
-                inlen = strlen(pParam);
-                if(matchlen > inlen)
-                {
-                    len = matchlen - inlen;
-                    if((bufPos + len) < MAX_CMD_BUF_SIZE)
-                    {
-                        strncat(cmdBuf, Params[idx].paramName + inlen, len);
-                        bufPos += len;
-                    }
-                    else
-                        len = 0;
-                }
-            }
-        }
+        len = CompleteParam(pParam);
+        inlen = strlen(pParam) - len;
     }
     else if(bufPos)
     {
@@ -375,7 +1369,7 @@ void microBox::HandleTab()
         idx = GetCmdIdx(pParam);
         if(idx >= 0)
         {
-            parlen = strlen(Cmds[idx].cmdName);
+            parlen = strlen(CmdName(idx, name));
             matchlen = parlen;
             idx2=idx;
             while((idx2=GetCmdIdx(pParam, idx2+1))!= -1)
@@ -390,7 +1384,7 @@ void microBox::HandleTab()
                 len = matchlen - inlen;
                 if((bufPos + len) < MAX_CMD_BUF_SIZE)
                 {
-                    strncat(cmdBuf, Cmds[idx].cmdName + inlen, len);
+                    strncat(cmdBuf, CmdName(idx, name) + inlen, len);
                     bufPos += len;
                 }
                 else
@@ -400,8 +1394,78 @@ void microBox::HandleTab()
     }
     if(len > 0)
     {
-        Serial.print(pParam + inlen);
+        out.print(pParam + inlen);
+    }
+}
+
+// Completes a path below /dev in cmdBuf up to the longest common prefix
+// of all matches, directories up to their '/'. Returns the added length.
+uint8_t microBox::CompleteParam(char *pParam)
+{
+    char pre[MAX_PATH_LEN];
+    char *path;
+    char *pSlash;
+    char *pFile;
+    const char *pFirst;
+    const char *pName;
+    uint8_t pos, preLen, matchLen, k;
+
+    pSlash = strrchr(pParam, '/');
+    if(pSlash != NULL)
+    {
+        pFile = pSlash + 1;
+        *pSlash = 0;
+        path = ResolvePath(pSlash == pParam ? "/" : pParam);
+        *pSlash = '/';
+    }
+    else
+    {
+        pFile = pParam;
+        path = ResolvePath(".");
+    }
+    if(path == NULL || strncmp_P(path, PSTR("/dev"), 4) != 0 || (path[4] != 0 && path[4] != '/'))
+        return 0;
+
+    pre[0] = 0;
+    if(path[4] != 0)
+    {
+        strcpy(pre, path + 5);
+        strcat_P(pre, PSTR("/"));
+    }
+    if(strlen(pre) + strlen(pFile) >= MAX_PATH_LEN)
+        return 0;
+    strcat(pre, pFile);
+    preLen = strlen(pre);
+
+    pos = LowerBound(pre, preLen);
+    if(pos >= paramCnt || strncmp(Param(paramOrder[pos]).paramName, pre, preLen) != 0)
+        return 0;
+    pFirst = Param(paramOrder[pos]).paramName;
+    matchLen = strlen(pFirst);
+    while(++pos < paramCnt)
+    {
+        pName = Param(paramOrder[pos]).paramName;
+        if(strncmp(pName, pre, preLen) != 0)
+            break;
+        k = preLen;
+        while(k < matchLen && pName[k] == pFirst[k])
+            k++;
+        matchLen = k;
+    }
+    for(k=preLen;k<matchLen;k++)
+    {
+        if(pFirst[k] == '/')
+        {
+            matchLen = k + 1;
+            break;
+        }
     }
+    matchLen -= preLen;
+    if(matchLen == 0 || bufPos + matchLen >= MAX_CMD_BUF_SIZE)
+        return 0;
+    strncat(cmdBuf, pFirst + preLen, matchLen);
+    bufPos += matchLen;
+    return matchLen;
 }
 
 void microBox::HistoryUp()
@@ -446,11 +1510,11 @@ void microBox::HistoryPrintHlpr()
 
     len = strlen(cmdBuf);
     for(i=0;i<bufPos;i++)
-        Serial.print('\b');
-    Serial.print(cmdBuf);
+        out.print('\b');
+    out.print(cmdBuf);
     if(len<bufPos)
     {
-        Serial.print(F("\x1B[K"));
+        out.print(F("\x1B[K"));
     }
     bufPos = len;
 }
@@ -486,11 +1550,18 @@ void microBox::sendTelnetOpt(uint8_t option, uint8_t value)
     tmp[1] = option;
     tmp[2] = value;
     tmp[3] = 0;
-    Serial.write(tmp, 4);
+    out.write(tmp, 4);
+#if MB_PROFILING
+    telnetSent++;
+#endif
 }
 
 void microBox::handleTelnet(uint8_t ch)
 {
+#if MB_PROFILING
+    if(stateTelnet >= TELNET_STATE_WILL && stateTelnet <= TELNET_STATE_DONT)
+        telnetRecv++;
+#endif
     switch (stateTelnet)
     {
     case TELNET_STATE_IAC:
@@ -557,420 +1628,2454 @@ void microBox::handleTelnet(uint8_t ch)
 
 void microBox::ErrorDir(const __FlashStringHelper *cmd)
 {
-    Serial.print(cmd);
-    Serial.println(F(": File or directory not found\n"));
+    out.print(cmd);
+    PrintError(F(": File or directory not found\n"));
+}
+
+// Every failing command reports through here, so "&&", "||" and rpc
+// replies see its status
+void microBox::PrintError(const __FlashStringHelper *pMsg)
+{
+    cmdStatus = RC_ERROR;
+    out.println(pMsg);
+}
+
+// Builds the absolute, normalized path of pParam in pathBuf. Handles
+// relative paths, "." and ".." at any depth.
+char *microBox::ResolvePath(const char *pParam)
+{
+    uint8_t pos = 0;
+    uint8_t len;
+    const char *pEnd;
+
+    if(pParam == NULL)
+        return NULL;
+    if(pParam[0] != '/' && currentDir[1] != 0)
+    {
+        strcpy(pathBuf, currentDir);
+        pos = strlen(pathBuf);
+    }
+    pathBuf[pos] = 0;
+
+    while(*pParam != 0)
+    {
+        while(*pParam == '/')
+            pParam++;
+        if(*pParam == 0)
+            break;
+        pEnd = strchr(pParam, '/');
+        if(pEnd == NULL)
+            pEnd = pParam + strlen(pParam);
+        len = pEnd - pParam;
+        if(len == 2 && pParam[0] == '.' && pParam[1] == '.')
+        {
+            while(pos > 0 && pathBuf[pos-1] != '/')
+                pos--;
+            if(pos > 0)
+                pos--;
+        }
+        else if(!(len == 1 && pParam[0] == '.'))
+        {
+            if(pos + len + 2 > MAX_PATH_LEN)
+                return NULL;
+            pathBuf[pos++] = '/';
+            memcpy(pathBuf + pos, pParam, len);
+            pos += len;
+        }
+        pathBuf[pos] = 0;
+        pParam = pEnd;
+    }
+    if(pos == 0)
+    {
+        pathBuf[0] = '/';
+        pathBuf[1] = 0;
+    }
+    return pathBuf;
 }
 
-char *microBox::GetDir(char *pParam, bool useFile)
+// Classifies an absolute path from ResolvePath
+uint8_t microBox::GetNode(char *pPath, int16_t *pIdx)
 {
     uint8_t i=0;
     uint8_t len;
-    char *tmp;
+    char *pRest;
+#if MB_STATS
+    char *pSlash;
+#endif
 
-    dirBuf[0] = 0;
-    if(pParam != NULL)
+    if(pPath[1] == 0)
+        return NODE_DIR;
+
+    pPath++;
+    pRest = strchr(pPath, '/');
+    if(pRest != NULL)
+        len = pRest++ - pPath;
+    else
+        len = strlen(pPath);
+
+    while(pgm_read_byte_near(&dirList[i][0]) != 0)
+    {
+        if(strncmp_P(pPath, dirList[i], len) == 0 && strlen_P(dirList[i]) == len)
+            break;
+        i++;
+    }
+    if(pgm_read_byte_near(&dirList[i][0]) == 0)
+        return NODE_NONE;
+    if(pRest == NULL)
+        return NODE_DIR;
+
+    if(strcmp_P(dirList[i], PSTR("dev")) == 0)
+    {
+        len = strlen(pRest);
+        *pIdx = FindParam(pRest, len);
+        if(*pIdx != -1)
+            return NODE_PARAM;
+        if(IsParamDir(pRest, len))
+            return NODE_DIR;
+    }
+    else if(strcmp_P(dirList[i], PSTR("proc")) == 0)
     {
-        if(currentDir[1] != 0)
+        for(i=0;pgm_read_byte_near(&procFiles[i][0]) != 0;i++)
         {
-            if(pParam[0] != '/')
-            {
-                if(!(pParam[0] == '.' && pParam[1] == '.'))
-                {
-                    return NULL;
-                }
-                else
-                {
-                    pParam += 2;
-                    if(pParam[0] == 0)
-                    {
-                        dirBuf[0] = '/';
-                        dirBuf[1] = 0;
-                    }
-                    else if(pParam[0] != '/')
-                        return NULL;
-                }
-            }
+            if(strcmp_P(pRest, procFiles[i]) == 0)
+                return NODE_FILE;
+        }
+#if MB_STATS
+        len = strlen(pRest);
+        for(i=0;i<MAX_STATS;i++)
+        {
+            if(StatEntry(i, pRest, len) != NULL)
+                return NODE_DIR;
+        }
+        pSlash = strrchr(pRest, '/');
+        if(pSlash != NULL && strcmp_P(pSlash+1, PSTR("stats")) == 0 && FindStat(pRest, pSlash - pRest) != -1)
+            return NODE_FILE;
+#endif
+    }
+    return NODE_NONE;
+}
+
+// Sorts the parameter names once so lookups, directory listings and tab
+// completion are binary searches over paramOrder. Parameters that do not
+// fit the index are left out of the shell and the EEPROM image, the
+// table itself is not changed.
+bool microBox::BuildParamIndex()
+{
+    uint8_t i, j;
+    uint8_t idx;
+    int cnt = 0;
+    bool fits = true;
+
+    while(Param(cnt).paramName != NULL)
+        cnt++;
+    if(cnt > paramOrderSize)
+    {
+        fits = false;
+        out.print(F("microBox: "));
+        out.print(cnt);
+        out.print(F(" parameters, the index holds "));
+        out.print(paramOrderSize);
+        out.println(F(", see SetParamIndex()"));
+        cnt = paramOrderSize;
+    }
+    paramCnt = 0;
+    while(paramCnt < cnt)
+    {
+        idx = paramCnt;
+        for(i=0;i<paramCnt;i++)
+        {
+            if(strcmp(Param(idx).paramName, Param(paramOrder[i]).paramName) < 0)
+                break;
         }
-        if(pParam[0] == '/')
+        for(j=paramCnt;j>i;j--)
+            paramOrder[j] = paramOrder[j-1];
+        paramOrder[i] = idx;
+        paramCnt++;
+    }
+    return fits;
+}
+
+// First position whose name is not below the first len chars of pName
+uint8_t microBox::LowerBound(const char *pName, uint8_t len)
+{
+    uint8_t lo = 0;
+    uint8_t hi = paramCnt;
+    uint8_t mid;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(strncmp(Param(paramOrder[mid]).paramName, pName, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int16_t microBox::FindParam(const char *pName, uint8_t len)
+{
+    uint8_t pos;
+    const char *pFound;
+
+    pos = LowerBound(pName, len);
+    if(pos < paramCnt)
+    {
+        pFound = Param(paramOrder[pos]).paramName;
+        if(strncmp(pFound, pName, len) == 0 && pFound[len] == 0)
+            return paramOrder[pos];
+    }
+    return -1;
+}
+
+// True if a parameter name starts with pName followed by '/'
+bool microBox::IsParamDir(const char *pName, uint8_t len)
+{
+    uint8_t pos;
+    const char *pFound;
+
+    if(len == 0)
+        return true;
+    for(pos=LowerBound(pName, len);pos<paramCnt;pos++)
+    {
+        pFound = Param(paramOrder[pos]).paramName;
+        if(strncmp(pFound, pName, len) != 0 || pFound[len] > '/')
+            break;
+        if(pFound[len] == '/')
+            return true;
+    }
+    return false;
+}
+
+bool microBox::HasGlob(const char *pParam)
+{
+    return pParam != NULL && strpbrk_P(pParam, PSTR("*?")) != NULL;
+}
+
+// '*' matches any run of characters and '?' a single one, neither
+// crosses a '/' so patterns stay within one directory.
+bool microBox::MatchGlob(const char *pPat, const char *pName)
+{
+    const char *pStar = NULL;
+    const char *pBack = NULL;
+
+    while(*pName != 0)
+    {
+        if(*pPat == '*')
+        {
+            pStar = ++pPat;
+            pBack = pName;
+        }
+        else if(*pPat == *pName || (*pPat == '?' && *pName != '/'))
+        {
+            pPat++;
+            pName++;
+        }
+        else if(pStar != NULL && *pBack != '/')
+        {
+            pPat = pStar;
+            pName = ++pBack;
+        }
+        else
+            return false;
+    }
+    while(*pPat == '*')
+        pPat++;
+    return *pPat == 0;
+}
+
+// Copies the next parameters matching pParam, at most maxCnt, to
+// pIdxList and returns their number, 0 when done. *pPos is 0 on the first
+// call and keeps the index position for the next one, so any number of
+// matches is walked in chunks. A pattern only scans the index range
+// sharing its literal prefix, matches come out in name order.
+uint8_t microBox::ExpandParams(char *pParam, uint8_t *pPos, uint8_t *pIdxList, uint8_t maxCnt)
+{
+    uint8_t pos;
+    uint8_t cnt = 0;
+    uint8_t preLen;
+    char *path;
+    int16_t idx;
+    const char *pName;
+
+    path = ResolvePath(pParam);
+    if(path == NULL || strncmp_P(path, PSTR("/dev/"), 5) != 0)
+        return 0;
+    path += 5;
+    preLen = strcspn_P(path, PSTR("*?"));
+    if(path[preLen] == 0)
+    {
+        idx = FindParam(path, preLen);
+        if(idx == -1 || *pPos != 0)
+            return 0;
+        *pPos = 1;
+        pIdxList[0] = idx;
+        return 1;
+    }
+    pos = *pPos;
+    if(pos == 0)
+        pos = LowerBound(path, preLen);
+    for(;pos<paramCnt && cnt<maxCnt;pos++)
+    {
+        pName = Param(paramOrder[pos]).paramName;
+        if(strncmp(pName, path, preLen) != 0)
+        {
+            pos = paramCnt;
+            break;
+        }
+        if(MatchGlob(path + preLen, pName + preLen))
+            pIdxList[cnt++] = paramOrder[pos];
+    }
+    *pPos = pos;
+    return cnt;
+}
+
+uint8_t microBox::ParamSize(uint8_t idx)
+{
+    PARAM_ENTRY par = Param(idx);
+
+    if(par.parType&PARTYPE_INT)
+        return sizeof(int);
+    else if(par.parType&PARTYPE_DOUBLE)
+        return sizeof(double);
+    return par.len;
+}
+
+void microBox::ListDirHlp(bool dir, bool rw, int len)
+{
+    char mode[4];
+
+    mode[1] = 'r';
+    mode[3] = 0;
+    if(dir)
+        mode[0] = 'd';
+    else
+        mode[0] = '-';
+
+    if(rw)
+        mode[2] = 'w';
+    else
+        mode[2] = '-';
+
+    out.print(mode);
+
+    out.print(F("xr-xr-x\t2 root\troot\t"));
+    out.print(len);
+    out.print(F(" "));
+    out.print((const __FlashStringHelper*)fileDate);
+    out.print(F(" "));
+}
+
+// ls/ll accept several paths, wildcards list every matching parameter
+void microBox::ListDir(char **pParam, uint8_t parCnt, bool listLong)
+{
+    uint8_t i, j, cnt;
+    uint8_t pos;
+    uint8_t idxList[MAX_SNAPSHOT_PARAMS];
+
+    if(parCnt == 0)
+    {
+        ListPath(currentDir, listLong);
+        return;
+    }
+    for(i=0;i<parCnt;i++)
+    {
+        if(HasGlob(pParam[i]))
+        {
+            pos = 0;
+            cnt = ExpandParams(pParam[i], &pos, idxList, MAX_SNAPSHOT_PARAMS);
+            if(cnt == 0)
+            {
+                if(listLong)
+                    ErrorDir(F("ll"));
+                else
+                    ErrorDir(F("ls"));
+            }
+            for(;cnt>0;cnt=ExpandParams(pParam[i], &pos, idxList, MAX_SNAPSHOT_PARAMS))
+            {
+                for(j=0;j<cnt;j++)
+                    ListParamHlp(idxList[j], listLong);
+            }
+        }
+        else
+            ListPath(ResolvePath(pParam[i]), listLong);
+    }
+}
+
+void microBox::ListPath(char *dir, bool listLong)
+{
+    uint8_t i=0;
+    int16_t idx;
+    uint8_t node;
+    char name[MAX_CMD_NAME];
+
+    node = NODE_NONE;
+    if(dir != NULL)
+        node = GetNode(dir, &idx);
+    if(node == NODE_PARAM)
+    {
+        ListParamHlp(idx, listLong);
+        return;
+    }
+    if(node != NODE_DIR)
+    {
+        if(listLong)
+            ErrorDir(F("ll"));
+        else
+            ErrorDir(F("ls"));
+        return;
+    }
+
+    if(dir[1] == 0)
+    {
+        while(pgm_read_byte_near(&dirList[i][0]) != 0)
+        {
+            if(listLong)
+            {
+                ListDirHlp(true);
+            }
+            out.print((__FlashStringHelper*)dirList[i]);
+            if(listLong)
+                out.println();
+            else
+                out.print(F("\t"));
+            i++;
+        }
+        out.println();
+    }
+    else if(strcmp_P(dir, PSTR("/bin")) == 0)
+    {
+        while(i < MB_BUILTIN_CMDS+userCmdCnt)
+        {
+            if(listLong)
+            {
+                ListDirHlp(false);
+            }
+            out.println(CmdName(i, name));
+            i++;
+        }
+    }
+    else if(strncmp_P(dir, PSTR("/proc"), 5) == 0)
+    {
+        while(dir[5] == 0 && pgm_read_byte_near(&procFiles[i][0]) != 0)
+        {
+            if(listLong)
+            {
+                ListDirHlp(false, false, 0);
+            }
+            out.println((__FlashStringHelper*)procFiles[i]);
+            i++;
+        }
+#if MB_STATS
+        ListStats(dir + 5, listLong);
+#endif
+    }
+    else if(strncmp_P(dir, PSTR("/dev"), 4) == 0)
+    {
+        ListParams(dir + 4, listLong);
+    }
+}
+
+// Lists the entries of /dev<pDir>, subdirectories are the parameter name
+// components up to the next '/'. Names below one directory are adjacent
+// in paramOrder.
+void microBox::ListParams(char *pDir, bool listLong)
+{
+    uint8_t pos;
+    uint8_t preLen = 0;
+    const char *pName;
+    const char *pSub;
+    const char *pLastDir = NULL;
+    uint8_t lastLen = 0;
+    uint8_t len;
+
+    if(pDir[0] == '/')
+    {
+        pDir++;
+        preLen = strlen(pDir);
+    }
+    for(pos=LowerBound(pDir, preLen);pos<paramCnt;pos++)
+    {
+        pName = Param(paramOrder[pos]).paramName;
+        if(strncmp(pName, pDir, preLen) != 0)
+            break;
+        if(preLen != 0)
+        {
+            if(pName[preLen] != '/')
+                continue;
+            pName += preLen + 1;
+        }
+        pSub = strchr(pName, '/');
+        if(pSub == NULL)
+        {
+            ListParamHlp(paramOrder[pos], listLong);
+            continue;
+        }
+        len = pSub - pName;
+        if(pLastDir != NULL && len == lastLen && strncmp(pName, pLastDir, len) == 0)
+            continue;
+        pLastDir = pName;
+        lastLen = len;
+        if(listLong)
+        {
+            ListDirHlp(true);
+        }
+        out.write((const uint8_t*)pName, len);
+        out.println();
+    }
+}
+
+void microBox::ListParamHlp(uint8_t idx, bool listLong)
+{
+    const char *pName;
+
+    if(listLong)
+    {
+        ListDirHlp(false, Param(idx).parType&PARTYPE_RW, ParamSize(idx));
+    }
+    pName = strrchr(Param(idx).paramName, '/');
+    if(pName != NULL)
+        out.println(pName + 1);
+    else
+        out.println(Param(idx).paramName);
+}
+
+void microBox::ChangeDir(char **pParam, uint8_t parCnt)
+{
+    char *dir;
+    int16_t idx;
+
+    if(pParam[0] != NULL)
+    {
+        dir = ResolvePath(pParam[0]);
+        if(dir != NULL && GetNode(dir, &idx) == NODE_DIR)
+        {
+            strcpy(currentDir, dir);
+            return;
+        }
+    }
+    ErrorDir(F("cd"));
+}
+
+void microBox::PrintParam(uint8_t idx)
+{
+    PARAM_VALUE val;
+
+    ReadParam(idx, &val);
+    PrintParamVal(idx, &val);
+}
+
+void microBox::ReadParam(uint8_t idx, PARAM_VALUE *pVal)
+{
+    GetParam(idx);
+    CopyParam(idx, pVal);
+}
+
+// Calls getFunc unless the last result is younger than maxAge.
+void microBox::GetParam(uint8_t idx)
+{
+    PARAM_ENTRY par = Param(idx);
+    unsigned long m;
+    CACHE_ENTRY *pCache;
+
+    if(par.getFunc == NULL)
+        return;
+
+    pCache = FindCache(idx);
+    if(pCache != NULL)
+    {
+        m = millis();
+        if(m - pCache->lastGet < pCache->maxAge)
+        {
+            cacheHits++;
+            return;
+        }
+        pCache->lastGet = m;
+        cacheMisses++;
+    }
+    getFuncCalls++;
+    (*par.getFunc)(par.id);
+}
+
+// Backdates lastGet so the next read calls getFunc again.
+void microBox::InvalidateParam(uint8_t idx)
+{
+    CACHE_ENTRY *pCache = FindCache(idx);
+
+    if(pCache != NULL)
+        pCache->lastGet = millis() - pCache->maxAge;
+}
+
+CACHE_ENTRY *microBox::FindCache(uint8_t idx)
+{
+    uint8_t i;
+
+    for(i=0;i<MAX_CACHED_PARAMS;i++)
+    {
+        if(cacheEntries[i].maxAge != 0 && cacheEntries[i].idx == idx)
+            return &cacheEntries[i];
+    }
+    return NULL;
+}
+
+// Reads of paramName reuse the last getFunc result for maxAge ms, 0 ends
+// caching. Returns false if the parameter is unknown or the cache is full.
+bool microBox::SetMaxAge(const char *paramName, uint16_t maxAge)
+{
+    uint8_t i;
+    int16_t idx;
+    CACHE_ENTRY *pCache;
+
+    idx = FindParam(paramName, strlen(paramName));
+    if(idx == -1)
+        return false;
+    pCache = FindCache(idx);
+    for(i=0;i<MAX_CACHED_PARAMS && pCache == NULL;i++)
+    {
+        if(cacheEntries[i].maxAge == 0)
+            pCache = &cacheEntries[i];
+    }
+    if(pCache == NULL)
+        return maxAge == 0;
+    pCache->idx = idx;
+    pCache->maxAge = maxAge;
+    InvalidateParam(idx);
+    return true;
+}
+
+// Strings are not copied, PrintParamVal reads them in place.
+void microBox::CopyParam(uint8_t idx, PARAM_VALUE *pVal)
+{
+    PARAM_ENTRY par = Param(idx);
+
+    if(par.parType&PARTYPE_ATOMIC)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            if(par.parType&PARTYPE_INT)
+                pVal->i = *((int*)par.pParam);
+            else if(par.parType&PARTYPE_DOUBLE)
+                pVal->d = *((double*)par.pParam);
+        }
+    }
+    else
+    {
+        if(par.parType&PARTYPE_INT)
+            pVal->i = *((int*)par.pParam);
+        else if(par.parType&PARTYPE_DOUBLE)
+            pVal->d = *((double*)par.pParam);
+    }
+}
+
+void microBox::PrintParamVal(uint8_t idx, PARAM_VALUE *pVal, bool withName)
+{
+    PARAM_ENTRY par = Param(idx);
+
+    if(withName)
+    {
+        out.print(par.paramName);
+        out.print(F("="));
+    }
+    if(par.parType&PARTYPE_UNSIGNED)
+        out.print((unsigned int)pVal->i);
+    else if(par.parType&PARTYPE_INT)
+        out.print(pVal->i);
+    else if(par.parType&PARTYPE_DOUBLE)
+        out.print(pVal->d, 8);
+    else
+        out.print(((char*)par.pParam));
+
+    if(csvMode)
+        out.print(F(";"));
+    else
+        out.println();
+}
+
+int16_t microBox::GetParamIdx(char* pParam)
+{
+    char *path;
+
+    path = ResolvePath(pParam);
+    if(path == NULL || strncmp_P(path, PSTR("/dev/"), 5) != 0)
+        return -1;
+    return FindParam(path + 5, strlen(path + 5));
+}
+
+// Taken from Stream.cpp
+double microBox::parseFloat(char *pBuf)
+{
+    boolean isNegative = false;
+    boolean isFraction = false;
+    long value = 0;
+    unsigned char c;
+    double fraction = 1.0;
+    uint8_t idx = 0;
+
+    c = pBuf[idx++];
+    // ignore non numeric leading characters
+    if(c > 127)
+        return 0; // zero returned if timeout
+
+    do{
+        if(c == '-')
+            isNegative = true;
+        else if (c == '.')
+            isFraction = true;
+        else if(c >= '0' && c <= '9')  {      // is c a digit?
+            value = value * 10 + c - '0';
+            if(isFraction)
+                fraction *= 0.1;
+        }
+        c = pBuf[idx++];
+    }
+    while( (c >= '0' && c <= '9')  || c == '.');
+
+    if(isNegative)
+        value = -value;
+    if(isFraction)
+        return value * fraction;
+    else
+        return value;
+}
+
+// Decimal number without sign, false for anything else
+bool microBox::ParseNumber(const char *pStr, unsigned long *pVal)
+{
+    if(*pStr == 0 || pStr[strspn_P(pStr, PSTR("0123456789"))] != 0)
+        return false;
+    *pVal = strtoul(pStr, NULL, 10);
+    return true;
+}
+
+bool microBox::ParseParamVal(uint8_t idx, char *pStr, PARAM_VALUE *pVal)
+{
+    PARAM_ENTRY par = Param(idx);
+
+    if(par.parType & PARTYPE_UNSIGNED)
+        pVal->i = (int)strtoul(pStr, NULL, 10);
+    else if(par.parType & PARTYPE_INT)
+        pVal->i = atoi(pStr);
+    else if(par.parType & PARTYPE_DOUBLE)
+        pVal->d = parseFloat(pStr);
+    else if(strlen(pStr) >= par.len)
+        return false;
+    return true;
+}
+
+void microBox::StoreParam(uint8_t idx, PARAM_VALUE *pVal, const char *pStr)
+{
+    PARAM_ENTRY par = Param(idx);
+
+    if(par.parType & PARTYPE_INT)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            *((int*)par.pParam) = pVal->i;
+        }
+    }
+    else if(par.parType & PARTYPE_DOUBLE)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            *((double*)par.pParam) = pVal->d;
+        }
+    }
+    else
+        strcpy((char*)par.pParam, pStr);
+}
+
+// Stages a write in the transaction buffer, a parameter staged twice keeps
+// only the last value. String values are kept in transStrBuf.
+bool microBox::StageParam(uint8_t idx, char *pStr)
+{
+    uint8_t i;
+    uint8_t len;
+    TRANS_ENTRY *pEntry = NULL;
+
+    for(i=0;i<transCnt;i++)
+    {
+        if(transEntries[i].idx == idx)
+            pEntry = &transEntries[i];
+    }
+    if(pEntry == NULL)
+    {
+        if(transCnt >= MAX_TRANS_ENTRIES)
+            return false;
+        pEntry = &transEntries[transCnt];
+    }
+    if(!ParseParamVal(idx, pStr, &pEntry->val))
+        return false;
+    if(Param(idx).parType & PARTYPE_STRING)
+    {
+        len = strlen(pStr);
+        if(transStrPos + len + 1 > MAX_TRANS_STRBUF)
+            return false;
+        strcpy(transStrBuf + transStrPos, pStr);
+        pEntry->val.i = transStrPos;
+        transStrPos += len + 1;
+    }
+    if(pEntry == &transEntries[transCnt])
+        transCnt++;
+    pEntry->idx = idx;
+    return true;
+}
+
+// echo 82.00 > /dev/param, a pattern writes all matches as one
+// transaction
+void microBox::Echo(char **pParam, uint8_t parCnt)
+{
+    uint8_t i;
+    uint8_t cnt;
+    uint8_t total = 0;
+    uint8_t pos = 0;
+    uint8_t idxList[MAX_SNAPSHOT_PARAMS];
+    bool trans;
+    bool ok = true;
+
+    if((parCnt == 3) && (strcmp_P(pParam[1], PSTR(">")) == 0))
+    {
+        // all matches are checked before the first one is written
+        while((cnt = ExpandParams(pParam[2], &pos, idxList, MAX_SNAPSHOT_PARAMS)) != 0)
+        {
+            for(i=0;i<cnt;i++)
+            {
+                if(!(Param(idxList[i]).parType & PARTYPE_RW))
+                {
+                    PrintError(F("echo: File readonly"));
+                    return;
+                }
+            }
+            total += cnt;
+        }
+        if(total == 0)
+        {
+            ErrorDir(F("echo"));
+            return;
+        }
+        trans = (total > 1 && !transMode);
+        if(trans)
+            TransBegin();
+        pos = 0;
+        while(ok && (cnt = ExpandParams(pParam[2], &pos, idxList, MAX_SNAPSHOT_PARAMS)) != 0)
+        {
+            for(i=0;i<cnt && ok;i++)
+                ok = EchoParam(idxList[i], pParam[0]);
+        }
+        if(trans)
+        {
+            if(ok)
+                TransCommit();
+            else
+                TransAbort();
+        }
+    }
+    else
+    {
+        for(i=0;i<parCnt;i++)
+        {
+            out.print(pParam[i]);
+            out.print(F(" "));
+        }
+        out.println();
+    }
+}
+
+bool microBox::EchoParam(uint8_t idx, char *pVal)
+{
+    PARAM_ENTRY par = Param(idx);
+    PARAM_VALUE val;
+
+    if(transMode)
+    {
+        if(!StageParam(idx, pVal))
+        {
+            PrintError(F("echo: Transaction full"));
+            return false;
+        }
+    }
+    else if(ParseParamVal(idx, pVal, &val))
+    {
+        ParamWriteBegin();
+        StoreParam(idx, &val, pVal);
+        ParamWriteEnd();
+        InvalidateParam(idx);
+        if(par.setFunc != NULL)
+        {
+            setFuncCalls++;
+            (*par.setFunc)(par.id);
+        }
+    }
+    else
+    {
+        PrintError(F("echo: Value too long"));
+        return false;
+    }
+    return true;
+}
+
+void microBox::TransBegin()
+{
+    transMode = true;
+    transCnt = 0;
+    transStrPos = 0;
+}
+
+// Applies all staged writes inside one snapshot window, then fires every
+// distinct setFunc/id pair once.
+void microBox::TransCommit()
+{
+    uint8_t i, j;
+    uint8_t idx;
+    char *pStr;
+    PARAM_ENTRY par, other;
+
+    if(!transMode)
+    {
+        PrintError(F("commit: No transaction"));
+        return;
+    }
+    ParamWriteBegin();
+    for(i=0;i<transCnt;i++)
+    {
+        idx = transEntries[i].idx;
+        pStr = NULL;
+        if(Param(idx).parType & PARTYPE_STRING)
+            pStr = transStrBuf + transEntries[i].val.i;
+        StoreParam(idx, &transEntries[i].val, pStr);
+        InvalidateParam(idx);
+    }
+    ParamWriteEnd();
+    for(i=0;i<transCnt;i++)
+    {
+        par = Param(transEntries[i].idx);
+        if(par.setFunc == NULL)
+            continue;
+        for(j=0;j<i;j++)
+        {
+            other = Param(transEntries[j].idx);
+            if(other.setFunc == par.setFunc && other.id == par.id)
+                break;
+        }
+        if(j == i)
+        {
+            setFuncCalls++;
+            (*par.setFunc)(par.id);
+        }
+    }
+    TransAbort();
+}
+
+void microBox::TransAbort()
+{
+    transMode = false;
+    transCnt = 0;
+    transStrPos = 0;
+}
+
+// Several parameters, patterns and /proc files are checked up front.
+// Parameters are collected across arguments and printed in snapshots of
+// up to MAX_SNAPSHOT_PARAMS values, -k prefixes each value with "name="
+void microBox::Cat(char** pParam, uint8_t parCnt)
+{
+    uint8_t i, cnt;
+    uint8_t pos;
+    uint8_t idxList[MAX_SNAPSHOT_PARAMS];
+    uint8_t rowCnt = 0;
+    bool withName = false;
+    char *path;
+    int16_t idx;
+
+    if(parCnt > 0 && strcmp_P(pParam[0], PSTR("-k")) == 0)
+    {
+        withName = true;
+        pParam++;
+        parCnt--;
+    }
+    if(parCnt == 0 || (parCnt == 1 && !withName && !HasGlob(pParam[0])))
+    {
+        Cat_int(pParam[0]);
+        return;
+    }
+    for(i=0;i<parCnt;i++)
+    {
+        pos = 0;
+        if(HasGlob(pParam[i]))
+            cnt = ExpandParams(pParam[i], &pos, idxList, 1);
+        else
+        {
+            path = ResolvePath(pParam[i]);
+            cnt = path != NULL && GetNode(path, &idx) >= NODE_PARAM;
+        }
+        if(cnt == 0)
+        {
+            ErrorDir(F("cat"));
+            return;
+        }
+    }
+    for(i=0;i<parCnt;i++)
+    {
+        if(!HasGlob(pParam[i]) && GetNode(ResolvePath(pParam[i]), &idx) == NODE_FILE)
+        {
+            if(!CatRow(idxList, rowCnt, withName))
+                return;
+            rowCnt = 0;
+            Cat_int(pParam[i]);
+            continue;
+        }
+        pos = 0;
+        while((cnt = ExpandParams(pParam[i], &pos, idxList + rowCnt, MAX_SNAPSHOT_PARAMS - rowCnt)) != 0)
+        {
+            rowCnt += cnt;
+            if(rowCnt < MAX_SNAPSHOT_PARAMS)
+                continue;
+            if(!CatRow(idxList, rowCnt, withName))
+                return;
+            rowCnt = 0;
+        }
+    }
+    if(!CatRow(idxList, rowCnt, withName))
+        return;
+    if(csvMode)
+        out.println();
+}
+
+// Prints one snapshot. If writers keep the values changing nothing is
+// printed and the command fails, a watch tries again on its next run.
+bool microBox::CatRow(uint8_t *pIdx, uint8_t cnt, bool withName)
+{
+    uint8_t i;
+    PARAM_VALUE vals[MAX_SNAPSHOT_PARAMS];
+
+    if(cnt == 0)
+        return true;
+    if(!SnapshotParams(pIdx, vals, cnt))
+    {
+        PrintError(F("cat: Values changing"));
+        return false;
+    }
+    for(i=0;i<cnt;i++)
+        PrintParamVal(pIdx[i], &vals[i], withName);
+    return true;
+}
+
+uint8_t microBox::Cat_int(char* pParam)
+{
+    int16_t idx;
+
+    idx = GetParamIdx(pParam);
+    if(idx != -1)
+    {
+        PrintParam(idx);
+        return 1;
+    }
+#if MB_STATS
+    idx = GetStatIdx(pParam);
+    if(idx != -1)
+    {
+        PrintStat(idx);
+        return 1;
+    }
+#endif
+    if(CatProcFile(pParam))
+        return 1;
+    ErrorDir(F("cat"));
+    
+    return 0;
+}
+
+// watch [-n ms] command [params] [&]
+void microBox::watch(char** pParam, uint8_t parCnt)
+{
+    StartWatch(pParam, parCnt, false);
+}
+
+void microBox::watchcsv(char** pParam, uint8_t parCnt)
+{
+    StartWatch(pParam, parCnt, true);
+}
+
+// The watched line is stored in a job and re-dispatched by a scheduler
+// task. Foreground jobs end on the next keypress.
+void microBox::StartWatch(char **pParam, uint8_t parCnt, bool csv)
+{
+    uint8_t job;
+    unsigned long period = 500;
+#if !MB_JOBS
+    bool bg = false;
+#elif MB_RPC
+    bool bg = bgExec || rpcMode;
+#else
+    bool bg = bgExec;
+#endif
+
+    if(parCnt >= 2 && strcmp_P(pParam[0], PSTR("-n")) == 0)
+    {
+        if(!ParseNumber(pParam[1], &period))
+            period = 0;
+        pParam += 2;
+        parCnt -= 2;
+    }
+    if(parCnt == 0 || period == 0)
+    {
+        PrintError(F("Usage: watch [-n ms] command [&]"));
+        return;
+    }
+    // in a watch or cron job a new job per run would pile up, the job's
+    // own period takes the place of the watch period
+    if(jobExec)
+    {
+        WatchOnce(pParam, parCnt, csv);
+        return;
+    }
+    if(!bg && fgJob != -1)
+        KillJob(fgJob);
+    for(job=0;job<MAX_JOBS;job++)
+    {
+        if(jobs[job].task == -1)
+            break;
+    }
+    if(job == MAX_JOBS)
+    {
+        PrintError(F("watch: Too many jobs"));
+        return;
+    }
+    if(!JoinParams(jobs[job].cmdLine, pParam, parCnt))
+    {
+        PrintError(F("watch: Command too long"));
+        return;
+    }
+    jobs[job].csv = csv;
+    jobs[job].task = AddTask(JobTaskCB, period, job);
+    if(jobs[job].task == -1)
+    {
+        PrintError(F("watch: Too many tasks"));
+        return;
+    }
+    if(!RunJob(job))
+    {
+        KillJob(job);
+        return;
+    }
+    if(bg)
+    {
+        out.print(F("["));
+        out.print(job);
+        out.println(F("]"));
+    }
+    else
+        fgJob = job;
+}
+
+// Takes a single sample of the watched command
+void microBox::WatchOnce(char **pParam, uint8_t parCnt, bool csv)
+{
+    char line[MAX_CMD_BUF_SIZE];
+    bool csvPrev = csvMode;
+
+    if(!JoinParams(line, pParam, parCnt))
+    {
+        PrintError(F("watch: Command too long"));
+        return;
+    }
+    csvMode = csv;
+    RunChain(line, true);
+    csvMode = csvPrev;
+}
+
+// Output of jobs started outside a request is sent as {"job":n,...}
+bool microBox::RunJob(uint8_t job)
+{
+    bool found;
+    char line[MAX_CMD_BUF_SIZE];
+#if MB_RPC
+    bool event = rpcMode && !rpcFrame;
+    char num[4];
+
+    if(event)
+        RpcBegin(F("job"), itoa(job, num, 10));
+#endif
+    strcpy(line, jobs[job].cmdLine);
+    csvMode = jobs[job].csv;
+    jobExec = true;
+    found = RunChain(line, true);
+    jobExec = false;
+    csvMode = false;
+#if MB_RPC
+    if(event)
+        RpcEnd();
+#endif
+    return found;
+}
+
+// While a request's resumable command runs its reply is still open, job
+// and cron ticks then wait and run once it is closed
+void microBox::RunTaskJob(uint8_t job, bool cron)
+{
+#if MB_RPC
+    if(rpcFrame)
+    {
+        if(cron)
+            deferredCron |= 1 << job;
+        else
+            deferredJobs |= 1 << job;
+        return;
+    }
+#endif
+#if MB_CRON
+    if(cron)
+    {
+        RunCronJob(job);
+        return;
+    }
+#endif
+    RunJob(job);
+}
+
+#if MB_RPC
+void microBox::RunDeferred()
+{
+    uint8_t i;
+
+    if(rpcFrame || (deferredJobs | deferredCron) == 0)
+        return;
+    for(i=0;i<MAX_JOBS;i++)
+    {
+        if((deferredJobs & (1 << i)) && jobs[i].task != -1)
+            RunJob(i);
+    }
+#if MB_CRON
+    for(i=0;i<MAX_CRON_JOBS;i++)
+    {
+        if((deferredCron & (1 << i)) && cronTasks[i] != -1)
+            RunCronJob(i);
+    }
+#endif
+    deferredJobs = 0;
+    deferredCron = 0;
+}
+#endif
+
+void microBox::KillJob(uint8_t job)
+{
+    RemoveTask(jobs[job].task);
+    jobs[job].task = -1;
+    if(fgJob == job)
+        fgJob = -1;
+}
+
+// Joins parameters of the running command back into one command line
+// that tokenizes to the same parameters again: blanks and ;&|'"\ get a
+// backslash, an empty parameter becomes ''. A single parameter is taken
+// as the whole command line, so "watch 'cmd1; cmd2'" runs a chain. The
+// token lengths come from Tokenize.
+bool microBox::JoinParams(char *pDst, char **pParam, uint8_t parCnt)
+{
+    uint8_t i, j;
+    uint8_t len;
+    uint8_t pos = 0;
+    uint8_t *pLen = ParmLen + (pParam - ParmPtr);
+    char ch;
+
+    if(parCnt == 1)
+    {
+        if(pLen[0] >= MAX_CMD_BUF_SIZE)
+            return false;
+        memcpy(pDst, pParam[0], pLen[0]);
+        pDst[pLen[0]] = 0;
+        return true;
+    }
+    for(i=0;i<parCnt;i++)
+    {
+        len = pLen[i];
+        if(pos + 3 >= MAX_CMD_BUF_SIZE)
+            return false;
+        if(i > 0)
+            pDst[pos++] = ' ';
+        if(len == 0)
+        {
+            pDst[pos++] = '\'';
+            pDst[pos++] = '\'';
+        }
+        for(j=0;j<len;j++)
+        {
+            ch = pParam[i][j];
+            if(strchr_P(PSTR(" \t;&|'\"\\"), ch) != NULL)
+                pDst[pos++] = '\\';
+            if(pos + 1 >= MAX_CMD_BUF_SIZE)
+                return false;
+            pDst[pos++] = ch;
+        }
+    }
+    pDst[pos] = 0;
+    return true;
+}
+
+#if MB_JOBS
+void microBox::Jobs(char **pParam, uint8_t parCnt)
+{
+    uint8_t i;
+    char name[MAX_CMD_NAME];
+
+    for(i=0;i<MAX_JOBS;i++)
+    {
+        if(jobs[i].task == -1)
+            continue;
+        out.print(F("["));
+        out.print(i);
+        out.print(F("]\t"));
+        if(jobs[i].csv)
+            out.print(F("watchcsv "));
+        else
+            out.print(F("watch "));
+        out.println(jobs[i].cmdLine);
+    }
+    if(resCmd != -1 && resBg)
+    {
+        out.print(F("["));
+        out.print(MAX_JOBS);
+        out.print(F("]\t"));
+        out.println(CmdName(resCmd, name));
+    }
+}
+
+// kill [%]job
+void microBox::Kill(char **pParam, uint8_t parCnt)
+{
+    char *p;
+    uint8_t job;
+
+    if(parCnt == 1)
+    {
+        p = pParam[0];
+        if(p[0] == '%')
+            p++;
+        job = atoi(p);
+        if(job < MAX_JOBS && jobs[job].task != -1)
+        {
+            KillJob(job);
+            return;
+        }
+        if(job == MAX_JOBS && resCmd != -1 && resBg)
+        {
+            resState.cancel = true;
+            return;
+        }
+    }
+    PrintError(F("kill: No such job"));
+}
+#endif
+
+// cachestat [-r]
+void microBox::CacheStat(char **pParam, uint8_t parCnt)
+{
+    out.print(F("hits: "));
+    out.println(cacheHits);
+    out.print(F("misses: "));
+    out.println(cacheMisses);
+    if(parCnt == 1 && strcmp_P(pParam[0], PSTR("-r")) == 0)
+    {
+        cacheHits = 0;
+        cacheMisses = 0;
+    }
+}
+
+void microBox::Ps(char **pParam, uint8_t parCnt)
+{
+    uint8_t i;
+
+    out.println(F("TASK\tPERIOD\tNEXT\tOVERRUNS"));
+    for(i=0;i<MAX_TASKS;i++)
+    {
+        if(tasks[i].taskFunc == NULL)
+            continue;
+        out.print(i);
+        out.print(F("\t"));
+        out.print(tasks[i].period);
+        out.print(F("\t"));
+        out.print((long)(tasks[i].deadline - millis()));
+        out.print(F("\t"));
+        out.println(tasks[i].overruns);
+    }
+}
+
+#if MB_CRON
+// Schedules the stored jobs and runs the boot jobs once.
+void microBox::LoadCron()
+{
+    uint8_t i;
+    CRON_ENTRY entry;
+
+    for(i=0;i<MAX_CRON_JOBS;i++)
+    {
+        if(!ReadCron(i, &entry))
+            continue;
+        if(entry.period == 0)
+            RunCronJob(i);
+        else
+            cronTasks[i] = AddTask(CronTaskCB, entry.period, i);
+    }
+}
+
+// Reads a stored job, false for free slots and for entries that are
+// erased, from another layout version or damaged
+bool microBox::ReadCron(uint8_t job, CRON_ENTRY *pEntry)
+{
+
+    eeprom_read_block(pEntry, EE_PTR(CRON_EE(job)), sizeof(CRON_ENTRY));
+    if(pEntry->magic != CRON_MAGIC || pEntry->cmdLine[0] == 0 ||
+       memchr(pEntry->cmdLine, 0, MAX_CMD_BUF_SIZE) == NULL)
+        return false;
+    return pEntry->check == CronCheck(pEntry);
+}
+
+uint8_t microBox::CronCheck(CRON_ENTRY *pEntry)
+{
+    uint8_t i;
+    uint8_t sum = 0;
+
+    for(i=0;i<sizeof(pEntry->period);i++)
+        sum += ((uint8_t*)&pEntry->period)[i];
+    for(i=0;pEntry->cmdLine[i] != 0;i++)
+        sum += pEntry->cmdLine[i];
+    return sum;
+}
+
+void microBox::RunCronJob(uint8_t job)
+{
+    CRON_ENTRY entry;
+#if MB_RPC
+    bool event;
+    char num[4];
+#endif
+
+    if(!ReadCron(job, &entry))
+        return;
+#if MB_RPC
+    event = rpcMode && !rpcFrame;
+    if(event)
+        RpcBegin(F("cron"), itoa(job, num, 10));
+#endif
+    jobExec = true;
+    RunChain(entry.cmdLine, true);
+    jobExec = false;
+#if MB_RPC
+    if(event)
+        RpcEnd();
+#endif
+}
+
+// cron [ls]
+// cron add ms|@boot command [params], e.g. cron add 1000 watchcsv cat /dev/temp_act
+// cron rm job
+// A watch in a job takes one sample per run.
+void microBox::Cron(char **pParam, uint8_t parCnt)
+{
+    uint8_t i;
+    CRON_ENTRY entry;
+    unsigned long job;
+
+    if(parCnt == 0 || strcmp_P(pParam[0], PSTR("ls")) == 0)
+    {
+        for(i=0;i<MAX_CRON_JOBS;i++)
+        {
+            if(!ReadCron(i, &entry))
+                continue;
+            out.print(i);
+            out.print(F("\t"));
+            if(entry.period == 0)
+                out.print(F("@boot"));
+            else
+                out.print(entry.period);
+            out.print(F("\t"));
+            out.println(entry.cmdLine);
+        }
+    }
+    else if(parCnt >= 3 && strcmp_P(pParam[0], PSTR("add")) == 0)
+    {
+        memset(&entry, 0, sizeof(entry));
+        if(strcmp_P(pParam[1], PSTR("@boot")) != 0 && !ParseNumber(pParam[1], &entry.period))
+        {
+            PrintError(F("cron: Period must be ms or @boot"));
+            return;
+        }
+        if(!JoinParams(entry.cmdLine, pParam+2, parCnt-2))
+        {
+            PrintError(F("cron: Command too long"));
+            return;
+        }
+        entry.magic = CRON_MAGIC;
+        entry.check = CronCheck(&entry);
+        for(i=0;i<MAX_CRON_JOBS;i++)
+        {
+            CRON_ENTRY old;
+
+            if(!ReadCron(i, &old))
+            {
+                eeprom_update_block(&entry, EE_PTR(CRON_EE(i)), sizeof(entry));
+                if(entry.period != 0)
+                    cronTasks[i] = AddTask(CronTaskCB, entry.period, i);
+                return;
+            }
+        }
+        PrintError(F("cron: Table full"));
+    }
+    else if(parCnt == 2 && strcmp_P(pParam[0], PSTR("rm")) == 0)
+    {
+        if(ParseNumber(pParam[1], &job) && job < MAX_CRON_JOBS)
+        {
+            eeprom_update_byte(EE_PTR(CRON_EE(job) + offsetof(CRON_ENTRY, magic)), 0);
+            RemoveTask(cronTasks[job]);
+            cronTasks[job] = -1;
+        }
+        else
+            PrintError(F("cron: No such job"));
+    }
+    else
+        PrintError(F("Usage: cron [ls] | cron add ms|@boot cmd | cron rm job"));
+}
+#endif
+
+#if MB_SCRIPTS
+// script [ls]
+// script add name command [params], appends to an existing script
+// script rm name
+void microBox::Script(char **pParam, uint8_t parCnt)
+{
+    uint8_t i;
+    int8_t ee;
+    uint8_t len;
+    EE_SCRIPT entry;
+    char line[MAX_CMD_BUF_SIZE];
+
+    if(parCnt == 0 || strcmp_P(pParam[0], PSTR("ls")) == 0)
+    {
+        for(i=0;i<MAX_SCRIPTS && scripts[i].name != NULL;i++)
+        {
+            out.print(scripts[i].name);
+            out.print(F("\t"));
+            out.println((const __FlashStringHelper*)scripts[i].script);
+        }
+        for(i=0;i<MAX_EE_SCRIPTS;i++)
+        {
+            eeprom_read_block(&entry, EE_PTR(SCRIPT_EE(i)), sizeof(entry));
+            if(entry.name[0] == 0 || (uint8_t)entry.name[0] == 0xFF)
+                continue;
+            entry.name[MAX_SCRIPT_NAME-1] = 0;
+            entry.script[MAX_SCRIPT_LEN-1] = 0;
+            out.print(entry.name);
+            out.print(F("\t"));
+            out.println(entry.script);
+        }
+    }
+    else if(parCnt >= 3 && strcmp_P(pParam[0], PSTR("add")) == 0)
+    {
+        len = strlen(pParam[1]);
+        if(len >= MAX_SCRIPT_NAME)
+        {
+            PrintError(F("script: Name too long"));
+            return;
+        }
+        ee = FindEEScript(pParam[1], len);
+        if(ee == -1)
+        {
+            for(i=0;i<MAX_EE_SCRIPTS;i++)
+            {
+                len = eeprom_read_byte(EE_PTR(SCRIPT_EE(i) + offsetof(EE_SCRIPT, name)));
+                if(len == 0 || len == 0xFF)
+                    break;
+            }
+            if(i == MAX_EE_SCRIPTS)
+            {
+                PrintError(F("script: Table full"));
+                return;
+            }
+            ee = i;
+            strcpy(entry.name, pParam[1]);
+            entry.script[0] = 0;
+        }
+        else
+            eeprom_read_block(&entry, EE_PTR(SCRIPT_EE(ee)), sizeof(entry));
+        if(!JoinParams(line, pParam+2, parCnt-2) ||
+           strlen(entry.script) + strlen(line) + 2 >= MAX_SCRIPT_LEN)
+        {
+            PrintError(F("script: Script too long"));
+            return;
+        }
+        if(entry.script[0] != 0)
+            strcat_P(entry.script, PSTR("; "));
+        strcat(entry.script, line);
+        eeprom_update_block(&entry, EE_PTR(SCRIPT_EE(ee)), sizeof(entry));
+    }
+    else if(parCnt == 2 && strcmp_P(pParam[0], PSTR("rm")) == 0)
+    {
+        ee = FindEEScript(pParam[1], strlen(pParam[1]));
+        if(ee != -1)
+            eeprom_update_byte(EE_PTR(SCRIPT_EE(ee) + offsetof(EE_SCRIPT, name)), 0);
+        else
+            ErrorDir(F("script"));
+    }
+    else
+        PrintError(F("Usage: script [ls] | script add name cmd | script rm name"));
+}
+#endif
+
+#if MB_RPC
+// rpc [on|off]
+void microBox::Rpc(char **pParam, uint8_t parCnt)
+{
+    if(parCnt == 0 || strcmp_P(pParam[0], PSTR("on")) == 0)
+        rpcMode = true;
+    else if(strcmp_P(pParam[0], PSTR("off")) == 0)
+        rpcMode = false;
+    else
+        PrintError(F("Usage: rpc [on|off]"));
+}
+#endif
+
+#if MB_CAPTURE || MB_STATS
+double microBox::ParamToDouble(uint8_t idx, PARAM_VALUE *pVal)
+{
+    PARAM_ENTRY par = Param(idx);
+
+    if(par.parType & PARTYPE_UNSIGNED)
+        return (unsigned int)pVal->i;
+    if(par.parType & PARTYPE_INT)
+        return pVal->i;
+    return pVal->d;
+}
+#endif
+
+#if MB_CAPTURE
+// Samples all channels into the ring. While armed the ring keeps running,
+// after the trigger it fills up so that capPre samples precede it.
+void microBox::CaptureSample()
+{
+    uint8_t i;
+    uint16_t depth;
+    PARAM_VALUE *pRow;
+    double val;
+    bool trig = false;
+
+    if(capState != CAP_ARMED && capState != CAP_RUNNING)
+        return;
+
+    depth = capSize / capChannels;
+    pRow = capBuf + capWr * capChannels;
+    for(i=0;i<capChannels;i++)
+        CopyParam(capIdx[i], &pRow[i]);
+    if(++capWr >= depth)
+        capWr = 0;
+    if(capCount < depth)
+        capCount++;
+
+    if(capState == CAP_ARMED)
+    {
+        val = ParamToDouble(capIdx[0], &pRow[0]);
+        if(capTrigMode == CAP_TRIG_NONE)
+            trig = true;
+        else if(capCount > 1 && capTrigMode == CAP_TRIG_RISE)
+            trig = (capLast < capTrigLevel && val >= capTrigLevel);
+        else if(capCount > 1 && capTrigMode == CAP_TRIG_FALL)
+            trig = (capLast > capTrigLevel && val <= capTrigLevel);
+        capLast = val;
+        if(trig)
+        {
+            capTrigPos = min(capCount, capPre + 1) - 1;
+            capPost = depth - capTrigPos - 1;
+            capState = CAP_RUNNING;
+        }
+    }
+    else
+        capPost--;
+
+    if(capState == CAP_RUNNING && capPost == 0)
+    {
+        capState = CAP_DONE;
+        RemoveTask(capTask);
+        capTask = -1;
+    }
+}
+
+void microBox::CaptureStatus()
+{
+    uint16_t cnt;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        cnt = capCount;
+    }
+    out.print(F("state: "));
+    if(capState == CAP_ARMED)
+        out.println(F("armed"));
+    else if(capState == CAP_RUNNING)
+        out.println(F("triggered"));
+    else if(capState == CAP_DONE)
+        out.println(F("done"));
+    else
+        out.println(F("idle"));
+    out.print(F("samples: "));
+    out.print(cnt);
+    out.print(F("/"));
+    if(capChannels != 0)
+        out.println(capSize / capChannels);
+    else
+        out.println(0);
+}
+
+void microBox::WriteVarint(unsigned int val)
+{
+    while(val >= 0x80)
+    {
+        out.write((uint8_t)(val | 0x80));
+        val >>= 7;
+    }
+    out.write((uint8_t)val);
+}
+
+// Text: first row absolute, later rows deltas, unchanged values are empty.
+// Binary: "MBC", channels, samples, rate, trigger position (LE), then per
+// sample a changed-channel mask followed by zigzag varint deltas for int
+// and raw bytes for double channels.
+void microBox::CaptureDump(bool binary)
+{
+    uint8_t i;
+    uint8_t mask;
+    uint16_t n, pos, depth;
+    uint16_t hdr[3];
+    PARAM_VALUE *pRow;
+    PARAM_VALUE *pPrev = NULL;
+    int delta;
+
+    depth = capSize / capChannels;
+    pos = (capWr + depth - capCount) % depth;
+    if(binary)
+    {
+        out.print(F("MBC"));
+        out.write(capChannels);
+        hdr[0] = capCount;
+        hdr[1] = capRate;
+        hdr[2] = capTrigPos;
+        for(i=0;i<3;i++)
+        {
+            out.write((uint8_t)hdr[i]);
+            out.write((uint8_t)(hdr[i] >> 8));
+        }
+    }
+    else
+    {
+        out.print(F("# rate="));
+        out.print(capRate);
+        out.print(F(" trig="));
+        out.println(capTrigPos);
+        for(i=0;i<capChannels;i++)
+        {
+            out.print(Param(capIdx[i]).paramName);
+            out.print(F(";"));
+        }
+        out.println();
+    }
+    for(n=0;n<capCount;n++)
+    {
+        pRow = capBuf + pos * capChannels;
+        mask = 0;
+        for(i=0;i<capChannels;i++)
+        {
+            if(pPrev == NULL || memcmp(&pRow[i], &pPrev[i], sizeof(PARAM_VALUE)) != 0)
+                mask |= 1 << i;
+        }
+        if(binary)
+            out.write(mask);
+        for(i=0;i<capChannels;i++)
+        {
+            if(mask & (1 << i))
+            {
+                if(Param(capIdx[i]).parType & PARTYPE_INT)
+                {
+                    delta = pRow[i].i - (pPrev ? pPrev[i].i : 0);
+                    if(binary)
+                        WriteVarint((unsigned int)((delta << 1) ^ (delta >> (sizeof(int)*8-1))));
+                    else
+                        out.print(delta);
+                }
+                else if(binary)
+                    out.write((uint8_t*)&pRow[i].d, sizeof(double));
+                else
+                    out.print(pRow[i].d - (pPrev ? pPrev[i].d : 0), 8);
+            }
+            if(!binary)
+                out.print(F(";"));
+        }
+        if(!binary)
+            out.println();
+        pPrev = pRow;
+        if(++pos >= depth)
+            pos = 0;
+    }
+}
+
+// capture [ch param [param ...] | rate ms | trig rise|fall|off level [pre] |
+//          start | stop | dump [bin]]
+void microBox::Capture(char **pParam, uint8_t parCnt)
+{
+    uint8_t i;
+    int16_t idx;
+
+    if(parCnt == 0)
+    {
+        CaptureStatus();
+        return;
+    }
+    if(strcmp_P(pParam[0], PSTR("stop")) == 0)
+    {
+        if(capState == CAP_ARMED || capState == CAP_RUNNING)
+        {
+            capState = CAP_DONE;
+            RemoveTask(capTask);
+            capTask = -1;
+        }
+        return;
+    }
+    if(capState == CAP_ARMED || capState == CAP_RUNNING)
+    {
+        PrintError(F("capture: Running"));
+        return;
+    }
+    if(strcmp_P(pParam[0], PSTR("ch")) == 0 && parCnt >= 2 && parCnt <= MAX_CAPTURE_CHANNELS+1)
+    {
+        for(i=1;i<parCnt;i++)
+        {
+            idx = GetParamIdx(pParam[i]);
+            if(idx == -1 || (Param(idx).parType & PARTYPE_STRING))
+            {
+                ErrorDir(F("capture"));
+                return;
+            }
+            capIdx[i-1] = idx;
+        }
+        capChannels = parCnt-1;
+        capState = CAP_IDLE;
+        capCount = 0;
+    }
+    else if(strcmp_P(pParam[0], PSTR("rate")) == 0 && parCnt == 2)
+        capRate = atoi(pParam[1]);
+    else if(strcmp_P(pParam[0], PSTR("trig")) == 0 && parCnt >= 2)
+    {
+        capTrigMode = CAP_TRIG_NONE;
+        if(parCnt >= 3)
+        {
+            if(strcmp_P(pParam[1], PSTR("rise")) == 0)
+                capTrigMode = CAP_TRIG_RISE;
+            else if(strcmp_P(pParam[1], PSTR("fall")) == 0)
+                capTrigMode = CAP_TRIG_FALL;
+            capTrigLevel = parseFloat(pParam[2]);
+        }
+        capPre = 0;
+        if(parCnt == 4)
+            capPre = atoi(pParam[3]);
+    }
+    else if(strcmp_P(pParam[0], PSTR("start")) == 0)
+    {
+        if(capBuf == NULL || capChannels == 0 || capSize < capChannels)
+        {
+            PrintError(F("capture: No buffer or channels"));
+            return;
+        }
+        capWr = 0;
+        capCount = 0;
+        capTrigPos = -1;
+        if(capRate != 0)
+        {
+            capTask = AddTask(CaptureTaskCB, capRate);
+            if(capTask == -1)
+            {
+                PrintError(F("capture: Too many tasks"));
+                return;
+            }
+        }
+        capState = CAP_ARMED;
+    }
+    else if(strcmp_P(pParam[0], PSTR("dump")) == 0)
+    {
+        if(capChannels != 0 && capCount != 0)
+            CaptureDump(parCnt == 2 && strcmp_P(pParam[1], PSTR("bin")) == 0);
+    }
+    else
+        PrintError(F("Usage: capture [ch p..|rate ms|trig rise|fall|off lvl [pre]|start|stop|dump [bin]]"));
+}
+#endif
+
+#if MB_STATS
+bool microBox::AddStatIdx(uint8_t idx, uint8_t window, unsigned long period)
+{
+    uint8_t i;
+
+    if(window == 0 || (Param(idx).parType & PARTYPE_STRING) || statBufUsed + window > statBufSize)
+        return false;
+    for(i=0;i<MAX_STATS;i++)
+    {
+        if(stats[i].window != 0 && stats[i].idx == idx)
+            RemoveStat(i);
+    }
+    for(i=0;i<MAX_STATS;i++)
+    {
+        if(stats[i].window == 0)
+        {
+            stats[i].task = AddTask(StatTaskCB, period, i);
+            if(stats[i].task == -1)
+                return false;
+            stats[i].pSamples = statBuf + statBufUsed;
+            statBufUsed += window;
+            stats[i].idx = idx;
+            stats[i].window = window;
+            stats[i].cnt = 0;
+            stats[i].pos = 0;
+            stats[i].mean = 0;
+            stats[i].m2 = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Frees the window samples and compacts the stats buffer
+void microBox::RemoveStat(uint8_t stat)
+{
+    uint8_t i;
+    double *pEnd;
+    uint8_t window = stats[stat].window;
+
+    RemoveTask(stats[stat].task);
+    pEnd = stats[stat].pSamples + window;
+    memmove(stats[stat].pSamples, pEnd, (statBuf + statBufUsed - pEnd) * sizeof(double));
+    statBufUsed -= window;
+    stats[stat].window = 0;
+    for(i=0;i<MAX_STATS;i++)
+    {
+        if(stats[i].window != 0 && stats[i].pSamples >= pEnd)
+            stats[i].pSamples -= window;
+    }
+}
+
+// Sliding window Welford update for mean/variance, min/max are only
+// rescanned when the evicted sample was the current extreme.
+void microBox::StatSample(uint8_t stat)
+{
+    STAT_ENTRY *pStat = &stats[stat];
+    PARAM_VALUE val;
+    double x, old, oldMean;
+    uint8_t i;
+    bool rescan = false;
+
+    ReadParam(pStat->idx, &val);
+    x = ParamToDouble(pStat->idx, &val);
+
+    if(pStat->cnt < pStat->window)
+    {
+        pStat->cnt++;
+        oldMean = pStat->mean;
+        pStat->mean += (x - oldMean) / pStat->cnt;
+        pStat->m2 += (x - oldMean) * (x - pStat->mean);
+    }
+    else
+    {
+        old = pStat->pSamples[pStat->pos];
+        oldMean = pStat->mean;
+        pStat->mean += (x - old) / pStat->window;
+        pStat->m2 += (x - old) * (x - pStat->mean + old - oldMean);
+        if(pStat->m2 < 0)
+            pStat->m2 = 0;
+        rescan = (old == pStat->min || old == pStat->max);
+    }
+    pStat->pSamples[pStat->pos] = x;
+    if(++pStat->pos >= pStat->window)
+        pStat->pos = 0;
+
+    if(rescan)
+    {
+        pStat->min = pStat->max = x;
+        for(i=0;i<pStat->cnt;i++)
+        {
+            if(pStat->pSamples[i] < pStat->min)
+                pStat->min = pStat->pSamples[i];
+            if(pStat->pSamples[i] > pStat->max)
+                pStat->max = pStat->pSamples[i];
+        }
+    }
+    else
+    {
+        if(pStat->cnt == 1 || x < pStat->min)
+            pStat->min = x;
+        if(pStat->cnt == 1 || x > pStat->max)
+            pStat->max = x;
+    }
+}
+
+// Resolves /proc/<param>/stats, param names may contain '/'
+int8_t microBox::GetStatIdx(char *pParam)
+{
+    char *pSlash;
+
+    pParam = GetProcPath(pParam);
+    if(pParam == NULL)
+        return -1;
+
+    pSlash = strrchr(pParam, '/');
+    if(pSlash == NULL || strcmp_P(pSlash+1, PSTR("stats")) != 0)
+        return -1;
+    return FindStat(pParam, pSlash - pParam);
+}
+
+// Part of the stat's parameter name below the /proc subdirectory pDir,
+// "" for the parameter's own directory, NULL if it is not below pDir
+const char *microBox::StatEntry(uint8_t stat, const char *pDir, uint8_t len)
+{
+    const char *pName;
+
+    if(stats[stat].window == 0)
+        return NULL;
+    pName = Param(stats[stat].idx).paramName;
+    if(len == 0)
+        return pName;
+    if(strncmp(pName, pDir, len) != 0)
+        return NULL;
+    if(pName[len] == 0)
+        return pName + len;
+    if(pName[len] == '/')
+        return pName + len + 1;
+    return NULL;
+}
+
+// Lists /proc<pDir>, parameter name components of the statistics below
+// it are directories like in /dev and a parameter's own directory holds
+// the stats file. A directory shared by several statistics is listed once.
+void microBox::ListStats(char *pDir, bool listLong)
+{
+    uint8_t i, j;
+    uint8_t preLen = 0;
+    const char *pName;
+    const char *pOther;
+    const char *pSub;
+    uint8_t len;
+
+    if(pDir[0] == '/')
+    {
+        pDir++;
+        preLen = strlen(pDir);
+    }
+    for(i=0;i<MAX_STATS;i++)
+    {
+        pName = StatEntry(i, pDir, preLen);
+        if(pName == NULL)
+            continue;
+        if(*pName == 0)
         {
-            if(pParam[1] == 0)
+            if(listLong)
             {
-                dirBuf[0] = '/';
-                dirBuf[1] = 0;
+                ListDirHlp(false, false, 0);
             }
-            pParam++;
+            out.println(F("stats"));
+            continue;
         }
-
-        if((tmp=strchr(pParam, '/')) != 0)
+        pSub = strchr(pName, '/');
+        len = (pSub != NULL) ? pSub - pName : strlen(pName);
+        for(j=0;j<i;j++)
         {
-            len = tmp-pParam;
+            pOther = StatEntry(j, pDir, preLen);
+            if(pOther != NULL && strncmp(pOther, pName, len) == 0 &&
+               (pOther[len] == 0 || pOther[len] == '/'))
+                break;
         }
-        else
-            len = strlen(pParam);
-        if(len > 0)
+        if(j < i)
+            continue;
+        if(listLong)
         {
-            while(pgm_read_byte_near(&dirList[i][0]) != 0)
-            {
-                if(strncmp_P(pParam, dirList[i], len) == 0)
-                {
-                    if(strlen_P(dirList[i]) == len)
-                    {
-                        dirBuf[0] = '/';
-                        dirBuf[1] = 0;
-                        strcat_P(dirBuf, dirList[i]);
-                        return dirBuf;
-                    }
-                }
-                i++;
-            }
+            ListDirHlp(true, false);
         }
+        out.write((const uint8_t*)pName, len);
+        out.println();
     }
-    if(dirBuf[0] != 0)
-        return dirBuf;
-    return NULL;
 }
 
-char *microBox::GetFile(char *pParam)
+// Statistic of the parameter named by the first len chars of pName
+int8_t microBox::FindStat(const char *pName, uint8_t len)
 {
-    char *file;
-    char *t;
+    uint8_t i;
+    const char *pParName;
 
-    file = pParam;
-    while((t=strchr(file, '/')) != NULL)
+    for(i=0;i<MAX_STATS;i++)
     {
-        file = t+1;
+        if(stats[i].window == 0)
+            continue;
+        pParName = Param(stats[i].idx).paramName;
+        if(strncmp(pParName, pName, len) == 0 && pParName[len] == 0)
+            return i;
     }
-    return file;
+    return -1;
 }
+#endif
 
-void microBox::ListDirHlp(bool dir, bool rw, int len)
+// Returns the path below /proc/ or NULL
+char *microBox::GetProcPath(char *pParam)
 {
-    cmdBuf[1] = 'r';
-    cmdBuf[3] = 0;
-    if(dir)
-        cmdBuf[0] = 'd';
-    else
-        cmdBuf[0] = '-';
+    char *path;
 
-    if(rw)
-        cmdBuf[2] = 'w';
-    else
-        cmdBuf[2] = '-';
+    path = ResolvePath(pParam);
+    if(path == NULL || strncmp_P(path, PSTR("/proc/"), 6) != 0)
+        return NULL;
+    return path + 6;
+}
 
-    Serial.print(cmdBuf);
-    cmdBuf[0] = 0;
+// Fills everything between heap and stack with STACK_PAINT, the lowest
+// overwritten byte later gives the stack high-water mark.
+void microBox::PaintStack()
+{
+#ifdef __AVR__
+    uint8_t *p = (uint8_t*)(__brkval == 0 ? &__heap_start : __brkval);
 
-    Serial.print(F("xr-xr-x\t2 root\troot\t"));
-    Serial.print(len);
-    Serial.print(F(" "));
-    Serial.print((const __FlashStringHelper*)fileDate);
-    Serial.print(F(" "));
+    while(p < (uint8_t*)SP - 32)
+        *p++ = STACK_PAINT;
+#endif
 }
 
-void microBox::ListDir(char **pParam, uint8_t parCnt, bool listLong)
+bool microBox::CatProcFile(char *pParam)
 {
-    uint8_t i=0;
-    char *dir;
+#if MB_PROFILING
+    uint8_t i;
+    char name[MAX_CMD_NAME];
+#endif
 
-    if(parCnt != 0)
-    {
-        dir = GetDir(pParam[0], false);
-        if(dir == NULL)
-        {
-            if(listLong)
-                ErrorDir(F("ll"));
-            else
-                ErrorDir(F("ls"));
-            return;
-        }
-    }
-    else
-    {
-        dir = currentDir;
-    }
+    pParam = GetProcPath(pParam);
+    if(pParam == NULL)
+        return false;
 
-    if(dir[1] == 0)
+    if(strcmp_P(pParam, PSTR("shell")) == 0)
     {
-        while(pgm_read_byte_near(&dirList[i][0]) != 0)
+#if MB_PROFILING
+        out.print(F("parser_calls: "));
+        out.println(parserCalls);
+        out.print(F("parser_max_us: "));
+        out.println(parserMaxUs);
+        out.print(F("parser_avg_us: "));
+        out.println(parserCalls ? parserTotalUs / parserCalls : 0);
+#endif
+        out.print(F("budget_overruns: "));
+        out.println(budgetOverruns);
+#if MB_PROFILING
+        out.print(F("bytes_in: "));
+        out.println(bytesIn);
+#endif
+        out.print(F("bytes_out: "));
+        out.println(out.bytesOut);
+        out.print(F("out_writes: "));
+        out.println(out.flushes);
+#if MB_PROFILING
+        out.print(F("chars_dropped: "));
+        out.println(charsDropped);
+        out.print(F("telnet_recv: "));
+        out.println(telnetRecv);
+        out.print(F("telnet_sent: "));
+        out.println(telnetSent);
+#endif
+        out.print(F("getfunc_calls: "));
+        out.println(getFuncCalls);
+        out.print(F("setfunc_calls: "));
+        out.println(setFuncCalls);
+        out.print(F("eeprom_save: "));
+        if(eeState == EE_IDLE)
+            out.println(F("idle"));
+        else
         {
-            if(listLong)
-            {
-                ListDirHlp(true);
-            }
-            Serial.print((__FlashStringHelper*)dirList[i]);
-            if(listLong)
-                Serial.println();
-            else
-                Serial.print(F("\t"));
-            i++;
+            out.print(eePos + eeOff);
+            out.print(F("/"));
+            out.println(eeSize);
         }
-        Serial.println();
     }
-    else if(strcmp_P(dir, PSTR("/bin")) == 0)
+#if MB_PROFILING
+    else if(strcmp_P(pParam, PSTR("cmds")) == 0)
     {
-        while(Cmds[i].cmdName != NULL)
+        out.println(F("CMD\tCALLS\tMAX_US"));
+        for(i=0;i<MB_BUILTIN_CMDS+userCmdCnt;i++)
         {
-            if(listLong)
-            {
-                ListDirHlp(false);
-            }
-            Serial.println(Cmds[i].cmdName);
-            i++;
+            if(cmdCalls[i] == 0)
+                continue;
+            out.print(CmdName(i, name));
+            out.print(F("\t"));
+            out.print(cmdCalls[i]);
+            out.print(F("\t"));
+            out.println(cmdMaxUs[i]);
         }
     }
-    else if(strcmp_P(dir, PSTR("/dev")) == 0)
+#endif
+    else if(strcmp_P(pParam, PSTR("meminfo")) == 0)
     {
-        while(Params[i].paramName != NULL)
-        {
-            if(listLong)
-            {
-                uint8_t size;
-                if(Params[i].parType&PARTYPE_INT)
-                    size=sizeof(int);
-                else if(Params[i].parType&PARTYPE_DOUBLE)
-                    size = sizeof(double);
-                else
-                    size = Params[i].len;
-
-                ListDirHlp(false, Params[i].parType&PARTYPE_RW, size);
-            }
-            Serial.println(Params[i].paramName);
-            i++;
-        }
-    }
-}
-
-void microBox::ChangeDir(char **pParam, uint8_t parCnt)
-{
-    char *dir;
+#ifdef __AVR__
+        uint8_t *pHeap = (uint8_t*)(__brkval == 0 ? &__heap_start : __brkval);
+        uint8_t *p = pHeap;
+        int v;
 
-    if(pParam[0] != NULL)
-    {
-        dir = GetDir(pParam[0], false);
-        if(dir != NULL)
-        {
-            strcpy(currentDir, dir);
-            return;
-        }
+        while(p < (uint8_t*)&v && *p == STACK_PAINT)
+            p++;
+        out.print(F("free: "));
+        out.println((int)&v - (int)pHeap);
+        out.print(F("stack_free_min: "));
+        out.println((int)(p - pHeap));
+#else
+        out.println(F("free: n/a"));
+#endif
     }
-    ErrorDir(F("cd"));
+    else
+        return false;
+    return true;
 }
 
-void microBox::PrintParam(uint8_t idx)
+#if MB_STATS
+void microBox::PrintStat(uint8_t stat)
 {
-    if(Params[idx].getFunc != NULL)
-        (*Params[idx].getFunc)(Params[idx].id);
+    STAT_ENTRY *pStat = &stats[stat];
 
-    if(Params[idx].parType&PARTYPE_INT)
-        Serial.print(*((int*)Params[idx].pParam));
-    else if(Params[idx].parType&PARTYPE_DOUBLE)
-        Serial.print(*((double*)Params[idx].pParam), 8);
+    out.print(F("min: "));
+    out.println(pStat->min, 8);
+    out.print(F("max: "));
+    out.println(pStat->max, 8);
+    out.print(F("mean: "));
+    out.println(pStat->mean, 8);
+    out.print(F("stddev: "));
+    if(pStat->cnt > 1)
+        out.println(sqrt(pStat->m2 / (pStat->cnt - 1)), 8);
     else
-        Serial.print(((char*)Params[idx].pParam));
-
-    if(csvMode)
-        Serial.print(F(";"));
-    else
-        Serial.println();
+        out.println(0.0, 8);
+    out.print(F("samples: "));
+    out.print(pStat->cnt);
+    out.print(F("/"));
+    out.println(pStat->window);
 }
 
-int8_t microBox::GetParamIdx(char* pParam, bool partStr, int8_t startIdx)
+// stats [add param window ms | rm param]
+void microBox::Stats(char **pParam, uint8_t parCnt)
 {
-    int8_t i=startIdx;
-    char *dir;
-    char *file;
+    uint8_t i;
+    int16_t idx = -1;
 
-    if(pParam != NULL)
+    if(parCnt == 0)
     {
-        dir = GetDir(pParam, true);
-        if(dir == NULL)
-            dir = currentDir;
-        if(dir != NULL)
+        for(i=0;i<MAX_STATS;i++)
         {
-            if(strcmp_P(dir, PSTR("/dev")) == 0)
-            {
-                file = GetFile(pParam);
-                if(file != NULL)
-                {
-                    while(Params[i].paramName != NULL)
-                    {
-                        if(partStr)
-                        {
-                            if(strncmp(Params[i].paramName, file, strlen(file))== 0)
-                            {
-                                return i;
-                            }
-                        }
-                        else
-                        {
-                            if(strcmp(Params[i].paramName, file)== 0)
-                            {
-                                return i;
-                            }
-                        }
-                        i++;
-                    }
-                }
-            }
+            if(stats[i].window == 0)
+                continue;
+            out.print(Param(stats[i].idx).paramName);
+            out.print(F("\t"));
+            out.print(stats[i].window);
+            out.print(F("\t"));
+            out.println(tasks[stats[i].task].period);
         }
+        return;
     }
-    return -1;
+    if(parCnt >= 2)
+        idx = GetParamIdx(pParam[1]);
+    if(parCnt == 4 && strcmp_P(pParam[0], PSTR("add")) == 0)
+    {
+        if(idx == -1)
+            ErrorDir(F("stats"));
+        else if(!AddStatIdx(idx, atoi(pParam[2]), atol(pParam[3])))
+            PrintError(F("stats: No space"));
+    }
+    else if(parCnt == 2 && strcmp_P(pParam[0], PSTR("rm")) == 0)
+    {
+        for(i=0;i<MAX_STATS;i++)
+        {
+            if(stats[i].window != 0 && stats[i].idx == idx)
+                RemoveStat(i);
+        }
+    }
+    else
+        PrintError(F("Usage: stats [add param window ms | rm param]"));
 }
+#endif
 
-// Taken from Stream.cpp
-double microBox::parseFloat(char *pBuf)
+// time command [params]
+// For resumable commands only the first slice is measured.
+void microBox::Time(char **pParam, uint8_t parCnt)
 {
-    boolean isNegative = false;
-    boolean isFraction = false;
-    long value = 0;
-    unsigned char c;
-    double fraction = 1.0;
-    uint8_t idx = 0;
-
-    c = pBuf[idx++];
-    // ignore non numeric leading characters
-    if(c > 127)
-        return 0; // zero returned if timeout
+    char line[MAX_CMD_BUF_SIZE];
+    unsigned long t;
+    unsigned long bytes;
+    unsigned long gets;
+    unsigned long sets;
+    char *pNext;
+    char op;
+    bool bg;
+    uint8_t tokCnt;
 
-    do{
-        if(c == '-')
-            isNegative = true;
-        else if (c == '.')
-            isFraction = true;
-        else if(c >= '0' && c <= '9')  {      // is c a digit?
-            value = value * 10 + c - '0';
-            if(isFraction)
-                fraction *= 0.1;
-        }
-        c = pBuf[idx++];
+    if(parCnt == 0 || !JoinParams(line, pParam, parCnt))
+    {
+        PrintError(F("Usage: time command"));
+        return;
     }
-    while( (c >= '0' && c <= '9')  || c == '.');
-
-    if(isNegative)
-        value = -value;
-    if(isFraction)
-        return value * fraction;
-    else
-        return value;
+    bytes = out.bytesOut;
+    gets = getFuncCalls;
+    sets = setFuncCalls;
+    t = micros();
+    tokCnt = Tokenize(line, &pNext, &op, &bg);
+    if(tokCnt == 0 || tokCnt > MAX_CMD_PARAMS + 1 || !Dispatch(tokCnt, bgExec || bg))
+    {
+        ErrorDir(F("time"));
+        return;
+    }
+    t = micros() - t;
+    bytes = out.bytesOut - bytes;
+    out.print(F("\nreal\t"));
+    out.print(t);
+    out.println(F(" us"));
+    out.print(F("bytes\t"));
+    out.println(bytes);
+    out.print(F("getfunc\t"));
+    out.println(getFuncCalls - gets);
+    out.print(F("setfunc\t"));
+    out.println(setFuncCalls - sets);
 }
 
-// echo 82.00 > /dev/param
-void microBox::Echo(char **pParam, uint8_t parCnt)
+// Loading is done at once, saving only starts the background writer
+void microBox::ReadWriteParamEE(bool write)
 {
-    uint8_t idx;
+    uint8_t i=0;
+    uint8_t psize;
+    int pos=0;
 
-    if((parCnt == 3) && (strcmp_P(pParam[1], PSTR(">")) == 0))
+    if(eeState != EE_IDLE)
     {
-        idx = GetParamIdx(pParam[2]);
-        if(idx != -1)
-        {
-            if(Params[idx].parType & PARTYPE_RW)
-            {
-                if(Params[idx].parType & PARTYPE_INT)
-                {
-                    int val;
-
-                    val = atoi(pParam[0]);
-                    *((int*)Params[idx].pParam) = val;
-                }
-                else if(Params[idx].parType & PARTYPE_DOUBLE)
-                {
-                    double val;
+        PrintError(F("EEPROM busy"));
+        return;
+    }
+    // the image would overwrite the EEPROM scripts and cron jobs
+    if(ParamImageSize() > (int)PARAM_EE_END)
+    {
+        PrintError(F("EEPROM too small"));
+        return;
+    }
+    while(i < paramCnt)
+    {
+        psize = ParamSize(i);
 
-                    val = parseFloat(pParam[0]);
-                    *((double*)Params[idx].pParam) = val;
-                }
-                else
-                {
-                    if(strlen(pParam[0]) < Params[idx].len)
-                        strcpy((char*)Params[idx].pParam, pParam[0]);
-                }
-                if(Params[idx].setFunc != NULL)
-                    (*Params[idx].setFunc)(Params[idx].id);
-            }
-            else
-                Serial.println(F("echo: File readonly"));
-        }
-        else
+        if(!write)
         {
-            ErrorDir(F("echo"));
+            eeprom_read_block(Param(i).pParam, EE_PTR(pos), psize);
+            InvalidateParam(i);
         }
+        pos += psize;
+        i++;
     }
-    else
+    if(write)
     {
-        for(idx=0;idx<parCnt;idx++)
-        {
-            Serial.print(pParam[idx]);
-            Serial.print(F(" "));
-        }
-        Serial.println();
+        eeSize = pos;
+        eeIdx = 0;
+        eeOff = 0;
+        eePos = 0;
+        eePass = 0;
+        eeBytes = 0;
+        eeSeq = paramSeq;
+        eeState = EE_WRITE;
     }
 }
 
-void microBox::Cat(char** pParam, uint8_t parCnt)
+// Bytes of the parameter image from EEPROM address 0
+int microBox::ParamImageSize()
 {
-    Cat_int(pParam[0]);
+    uint8_t i;
+    int size = 0;
+
+    for(i=0;i<paramCnt;i++)
+        size += ParamSize(i);
+    return size;
 }
 
-uint8_t microBox::Cat_int(char* pParam)
+// savepar runs as resumable command until the writer has finished, the
+// loop keeps running meanwhile. Ctrl-C only stops waiting.
+uint8_t microBox::SavePar(CMD_STATE *pState)
 {
-    int8_t idx;
-
-    idx = GetParamIdx(pParam);
-    if(idx != -1)
+    if(pState->calls == 0)
     {
-        PrintParam(idx);
-        return 1;
+        ReadWriteParamEE(true);
+        if(eeState != EE_WRITE)
+            return CMD_DONE;
     }
-    else
-        ErrorDir(F("cat"));
-    
-    return 0;
+    if(pState->cancel)
+    {
+        out.println(F("savepar: Continuing in background"));
+        return CMD_DONE;
+    }
+    if(eeState != EE_IDLE)
+        return CMD_BUSY;
+    out.print(F("savepar: "));
+    out.print(eeBytes);
+    out.print(F(" bytes written"));
+    if(!eeClean)
+        out.print(F(", parameters changed while saving"));
+    out.println();
+    return CMD_DONE;
 }
 
-void microBox::watch(char** pParam, uint8_t parCnt)
+// Background EEPROM writer, polled from cmdParser. It writes one changed
+// byte whenever the EEPROM is ready instead of busy waiting ~3.3ms per
+// byte. Each parameter is latched before its bytes are written, so no
+// value is torn.
+void microBox::EeWriterTick()
 {
-    if(parCnt == 2)
+    uint8_t psize;
+    uint8_t *pAddr;
+
+    if(eeState != EE_WRITE || !eeprom_is_ready() || !BudgetLeft())
+        return;
+    while(eeIdx < paramCnt)
     {
-        if(strncmp_P(pParam[0], PSTR("cat"), 3) == 0)
+        psize = ParamSize(eeIdx);
+        while(eeOff < psize)
         {
-            if(Cat_int(pParam[1]))
+            if(eeOff % MAX_EE_STAGE == 0)
+                LatchParam(eeIdx, eeOff);
+            pAddr = EE_PTR(eePos + eeOff);
+            if(eeprom_read_byte(pAddr) != eeStage[eeOff % MAX_EE_STAGE])
             {
-                strcpy(cmdBuf, pParam[1]);
-                watchMode = true;
+                eeprom_write_byte(pAddr, eeStage[eeOff % MAX_EE_STAGE]);
+                eeBytes++;
+                eeOff++;
+                return;
             }
+            eeOff++;
         }
+        eePos += psize;
+        eeOff = 0;
+        eeIdx++;
     }
+    // parameters written meanwhile by the shell or inside
+    // ParamWriteBegin/End get another pass, so the image ends up matching
+    // one point in time. Values that just drift, like sensor readings,
+    // are saved as latched.
+    eeClean = !(eeSeq & 1) && eeSeq == paramSeq;
+    eePass++;
+    eeIdx = 0;
+    eePos = 0;
+    eeSeq = paramSeq;
+    if(eeClean || eePass >= EE_MAX_PASSES)
+        eeState = EE_IDLE;
 }
 
-void microBox::watchcsv(char** pParam, uint8_t parCnt)
-{
-    watch(pParam, parCnt);
-    if(watchMode)
-        csvMode = true;
-}
-
-void microBox::ReadWriteParamEE(bool write)
+// Copies up to MAX_EE_STAGE bytes of a parameter from off into eeStage,
+// numbers are copied as a whole and atomically if needed.
+void microBox::LatchParam(uint8_t idx, uint8_t off)
 {
-    uint8_t i=0;
-    uint8_t psize;
-    int pos=0;
+    PARAM_ENTRY par = Param(idx);
+    PARAM_VALUE val;
+    uint8_t len;
 
-    while(Params[i].paramName != NULL)
+    if(par.parType & (PARTYPE_INT | PARTYPE_DOUBLE))
     {
-        if(Params[i].parType&PARTYPE_INT)
-            psize = sizeof(uint16_t);
-        else if(Params[i].parType&PARTYPE_DOUBLE)
-            psize = sizeof(double);
-        else
-            psize = Params[i].len;
-
-        if(write)
-            eeprom_write_block(Params[i].pParam, (void*)pos, psize);
-        else
-            eeprom_read_block(Params[i].pParam, (void*)pos, psize);
-        pos += psize;
-        i++;
+        CopyParam(idx, &val);
+        memcpy(eeStage, &val, ParamSize(idx));
+    }
+    else
+    {
+        len = min(par.len - off, MAX_EE_STAGE);
+        memcpy(eeStage, (uint8_t*)par.pParam + off, len);
     }
 }
 
@@ -1014,8 +4119,109 @@ void microBox::LoadParCB(char **pParam, uint8_t parCnt)
     microbox.ReadWriteParamEE(false);
 }
 
-void microBox::SaveParCB(char **pParam, uint8_t parCnt)
+uint8_t microBox::SaveParCB(char **pParam, uint8_t parCnt, CMD_STATE *pState)
+{
+    return microbox.SavePar(pState);
+}
+
+void microBox::TransBeginCB(char **pParam, uint8_t parCnt)
+{
+    microbox.TransBegin();
+}
+
+void microBox::TransCommitCB(char **pParam, uint8_t parCnt)
+{
+    microbox.TransCommit();
+}
+
+void microBox::TransAbortCB(char **pParam, uint8_t parCnt)
+{
+    microbox.TransAbort();
+}
+
+void microBox::CacheStatCB(char **pParam, uint8_t parCnt)
+{
+    microbox.CacheStat(pParam, parCnt);
+}
+
+void microBox::PsCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Ps(pParam, parCnt);
+}
+
+void microBox::JobTaskCB(uint8_t id)
+{
+    microbox.RunTaskJob(id, false);
+}
+
+#if MB_JOBS
+void microBox::JobsCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Jobs(pParam, parCnt);
+}
+
+void microBox::KillCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Kill(pParam, parCnt);
+}
+#endif
+
+#if MB_CRON
+void microBox::CronCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Cron(pParam, parCnt);
+}
+
+void microBox::CronTaskCB(uint8_t id)
+{
+    microbox.RunTaskJob(id, true);
+}
+#endif
+
+#if MB_RPC
+void microBox::RpcCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Rpc(pParam, parCnt);
+}
+#endif
+
+#if MB_SCRIPTS
+void microBox::ScriptCB(char **pParam, uint8_t parCnt)
 {
-    microbox.ReadWriteParamEE(true);
+    microbox.Script(pParam, parCnt);
 }
+#endif
 
+#if MB_CAPTURE
+void microBox::CaptureCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Capture(pParam, parCnt);
+}
+
+// Scheduler driven sampling runs in loop context, so getFunc may be used
+void microBox::CaptureTaskCB(uint8_t id)
+{
+    uint8_t i;
+
+    for(i=0;i<microbox.capChannels;i++)
+        microbox.GetParam(microbox.capIdx[i]);
+    microbox.CaptureSample();
+}
+#endif
+
+#if MB_STATS
+void microBox::StatsCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Stats(pParam, parCnt);
+}
+
+void microBox::StatTaskCB(uint8_t id)
+{
+    microbox.StatSample(id);
+}
+#endif
+
+void microBox::TimeCB(char **pParam, uint8_t parCnt)
+{
+    microbox.Time(pParam, parCnt);
+}
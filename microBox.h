@@ -11,16 +11,151 @@
 #define __PROG_TYPES_COMPAT__
 #include <Arduino.h>
 
-#define MAX_CMD_NUM 20
+// Optional features, each 0 or 1. 0 leaves the feature's commands, code
+// and RAM out. Set them with compiler flags, e.g. -DMB_PROFILING=1, or change
+// the defaults here.
+#ifndef MB_PROFILING
+#define MB_PROFILING 0      // /proc/cmds, parser, input and telnet counters
+#endif
+#ifndef MB_CAPTURE
+#define MB_CAPTURE 0        // capture command
+#endif
+#ifndef MB_STATS
+#define MB_STATS 0          // stats command, /proc/<param>/stats
+#endif
+#ifndef MB_JOBS
+#define MB_JOBS 0           // background jobs (&), jobs, kill
+#endif
+#ifndef MB_CRON
+#define MB_CRON 0           // cron and boot jobs stored in EEPROM
+#endif
+#ifndef MB_SCRIPTS
+#define MB_SCRIPTS 0        // named scripts, script command
+#endif
+#ifndef MB_RPC
+#define MB_RPC 0            // rpc machine mode
+#endif
+#ifndef MB_PARAMS_PROGMEM
+#define MB_PARAMS_PROGMEM 0 // the PARAM_ENTRY table is declared PROGMEM
+#endif
 
-#define MAX_CMD_BUF_SIZE 40
-#define MAX_PATH_LEN 10
+// commands added with AddCommand()
+#ifndef MAX_USER_CMDS
+#define MAX_USER_CMDS 10
+#endif
+// builtin commands are kept in flash, only user commands take RAM
+#define MB_BUILTIN_CMDS (15 + MB_CAPTURE + MB_STATS + 2*MB_JOBS + MB_CRON + MB_SCRIPTS + MB_RPC)
+#define MAX_CMD_NUM (MB_BUILTIN_CMDS + MAX_USER_CMDS)
+#define MAX_CMD_NAME 10
+
+// typed lines, job and cron command lines
+#ifndef MAX_CMD_BUF_SIZE
+#define MAX_CMD_BUF_SIZE 48
+#endif
+#define MAX_CMD_PARAMS 10
+// input typed while a foreground command runs, read ahead to find Ctrl-C
+#ifndef MAX_TYPEAHEAD
+#define MAX_TYPEAHEAD 16
+#endif
+#define MAX_PATH_LEN 32
+
+// size of the built in sorted parameter index. Larger PARAM_ENTRY tables
+// pass their own index buffer with SetParamIndex().
+#ifndef MAX_PARAMS
+#define MAX_PARAMS 32
+#endif
+static_assert(MAX_PARAMS <= 255, "microBox: MAX_PARAMS is limited to 255, parameters are indexed by uint8_t");
+
+#define NODE_NONE 0
+#define NODE_DIR 1
+#define NODE_PARAM 2
+#define NODE_FILE 3      // /proc files
 
 #define PARTYPE_INT    0x01
 #define PARTYPE_DOUBLE 0x02
 #define PARTYPE_STRING 0x04
 #define PARTYPE_RW     0x10
 #define PARTYPE_RO     0x00
+#define PARTYPE_ATOMIC 0x20
+#define PARTYPE_UNSIGNED 0x40   // with PARTYPE_INT: unsigned int
+
+// values cat and watch read in one consistent snapshot, longer rows are
+// consistent per MAX_SNAPSHOT_PARAMS values
+#ifndef MAX_SNAPSHOT_PARAMS
+#define MAX_SNAPSHOT_PARAMS 4
+#endif
+#define MAX_SNAPSHOT_RETRIES 4
+
+#define NO_TASK 0xFFFFFFFF
+
+#define MAX_CRON_JOBS 4
+#define CRON_MAGIC 0xC1     // 0xC0 + layout version
+
+#define MAX_SCRIPTS 4
+#define MAX_EE_SCRIPTS 2
+#define MAX_SCRIPT_NAME 8
+#define MAX_SCRIPT_LEN 64
+#define MAX_SCRIPT_NEST 8
+
+#define MAX_EE_STAGE 16
+#define EE_MAX_PASSES 3
+#define EE_IDLE 0
+#define EE_WRITE 1
+#if MB_JOBS
+#define MAX_JOBS 3
+#else
+// without job control the only job is a foreground watch
+#define MAX_JOBS 1
+#endif
+
+#define MAX_STATS 4
+
+// tasks added with AddTask(), the features add their own
+#ifndef MAX_USER_TASKS
+#define MAX_USER_TASKS 2
+#endif
+#define MAX_TASKS (MAX_USER_TASKS + MAX_JOBS + MB_CAPTURE + MB_STATS*MAX_STATS + MB_CRON*MAX_CRON_JOBS)
+
+// output is gathered and written to the Stream in one piece per cmdParser() pass
+#ifndef MAX_OUT_BUF
+#define MAX_OUT_BUF 32
+#endif
+
+#define MAX_CMD_STATE 16
+#define CMD_DONE 0
+#define CMD_BUSY 1
+
+#define CTRL_C 0x03
+
+// command exit status, reported by rpc replies
+#define RC_OK 0
+#define RC_ERROR 1
+#define RC_BADREQ 2
+#define RC_NOCMD 127
+
+#define MAX_CAPTURE_CHANNELS 4
+
+#define CAP_IDLE 0
+#define CAP_ARMED 1
+#define CAP_RUNNING 2
+#define CAP_DONE 3
+
+#define CAP_TRIG_NONE 0
+#define CAP_TRIG_RISE 1
+#define CAP_TRIG_FALL 2
+
+// parameters with a getFunc result cache, see SetMaxAge()
+#ifndef MAX_CACHED_PARAMS
+#define MAX_CACHED_PARAMS 4
+#endif
+
+// writes staged by begin, string values share MAX_TRANS_STRBUF bytes
+#ifndef MAX_TRANS_ENTRIES
+#define MAX_TRANS_ENTRIES 4
+#endif
+#ifndef MAX_TRANS_STRBUF
+#define MAX_TRANS_STRBUF 16
+#endif
 
 #define ESC_STATE_NONE 0
 #define ESC_STATE_START 1
@@ -43,12 +178,29 @@
 #define TELNET_STATE_DONT 5
 #define TELNET_STATE_CLOSE 6
 
+// State of a resumable command. param/parCnt are only valid on the first
+// call (calls == 0), later calls get NULL/0 and must work from data.
+typedef struct
+{
+    uint16_t calls;
+    bool cancel;        // Ctrl-C pressed, clean up and return CMD_DONE
+    uint8_t data[MAX_CMD_STATE];
+}CMD_STATE;
+
 typedef struct
 {
     const char *cmdName;
     void (*cmdFunc)(char **param, uint8_t parCnt);
+    uint8_t (*resFunc)(char **param, uint8_t parCnt, CMD_STATE *pState);
 }CMD_ENTRY;
 
+typedef struct
+{
+    char cmdName[MAX_CMD_NAME];
+    void (*cmdFunc)(char **param, uint8_t parCnt);
+    uint8_t (*resFunc)(char **param, uint8_t parCnt, CMD_STATE *pState);
+}BUILTIN_CMD;
+
 typedef struct
 {
     const char *paramName;
@@ -60,15 +212,219 @@ typedef struct
     uint8_t id;
 }PARAM_ENTRY;
 
+// getFunc result cache of one parameter, only kept for the parameters
+// given to SetMaxAge()
+typedef struct
+{
+    uint8_t idx;
+    uint16_t maxAge;        // ms a getFunc result stays valid, 0 = free
+    unsigned long lastGet;
+}CACHE_ENTRY;
+
+// Typed parameter registration, type and size are deduced from the
+// variable and unsupported types fail to compile:
+//   PARAM_ENTRY Params[] = { mb::param("pid/kp", Kp, mb::rw, PidSetParams), mb::end() };
+// With MB_PARAMS_PROGMEM the table is declared const PARAM_ENTRY Params[] PROGMEM.
+namespace mb
+{
+    const uint8_t ro = PARTYPE_RO;
+    const uint8_t rw = PARTYPE_RW;
+    const uint8_t atomic = PARTYPE_ATOMIC;
+
+    template<typename T> struct ParamType
+    {
+        static_assert(sizeof(T) == 0, "microBox: parameter must be int, unsigned int, double or char[]");
+    };
+    template<> struct ParamType<int>
+    {
+        static const uint8_t type = PARTYPE_INT;
+    };
+    template<> struct ParamType<unsigned int>
+    {
+        static const uint8_t type = PARTYPE_INT | PARTYPE_UNSIGNED;
+    };
+    template<> struct ParamType<double>
+    {
+        static const uint8_t type = PARTYPE_DOUBLE;
+    };
+#ifdef __AVR__
+    // double is a float on AVR
+    template<> struct ParamType<float>
+    {
+        static const uint8_t type = PARTYPE_DOUBLE;
+    };
+#endif
+    template<size_t N> struct ParamType<char[N]>
+    {
+        static_assert(N < 256, "microBox: string parameters are limited to 255 bytes");
+        static const uint8_t type = PARTYPE_STRING;
+    };
+
+    template<typename T>
+    constexpr PARAM_ENTRY param(const char *name, T &var, uint8_t access = ro,
+                                void (*setFunc)(uint8_t id) = NULL, void (*getFunc)(uint8_t id) = NULL,
+                                uint8_t id = 0)
+    {
+        return PARAM_ENTRY{name, &var, (uint8_t)(ParamType<T>::type | access),
+                           (uint8_t)((ParamType<T>::type & PARTYPE_STRING) ? sizeof(T) : 0),
+                           setFunc, getFunc, id};
+    }
+
+    constexpr PARAM_ENTRY end()
+    {
+        return PARAM_ENTRY{NULL, NULL, 0, 0, NULL, NULL, 0};
+    }
+}
+
+typedef union
+{
+    int i;
+    double d;
+}PARAM_VALUE;
+
+typedef struct
+{
+    uint8_t idx;
+    PARAM_VALUE val;
+}TRANS_ENTRY;
+
+typedef struct
+{
+    void (*taskFunc)(uint8_t id);
+    unsigned long period;
+    unsigned long deadline;
+    uint16_t overruns;
+    uint8_t id;
+}TASK_ENTRY;
+
+typedef struct
+{
+    uint8_t magic;          // CRON_MAGIC, anything else is a free slot
+    uint8_t check;          // sum of the period and command line bytes
+    unsigned long period;   // 0 = run once at boot, from the first cmdParser() run
+    char cmdLine[MAX_CMD_BUF_SIZE];
+}CRON_ENTRY;
+
+// Script registered by AddScript, the script text is stored in PROGMEM
+typedef struct
+{
+    const char *name;
+    const char *script;
+}SCRIPT_ENTRY;
+
+typedef struct
+{
+    char name[MAX_SCRIPT_NAME];
+    char script[MAX_SCRIPT_LEN];
+}EE_SCRIPT;
+
+typedef struct
+{
+    char cmdLine[MAX_CMD_BUF_SIZE];
+    int8_t task;            // -1 = free
+    bool csv;
+}JOB_ENTRY;
+
+typedef struct
+{
+    double *pSamples;       // window values taken from the stats buffer
+    double mean;
+    double m2;
+    double min;
+    double max;
+    uint8_t idx;
+    uint8_t window;         // 0 = free
+    uint8_t cnt;
+    uint8_t pos;
+    int8_t task;
+}STAT_ENTRY;
+
+// cron and script tables live at the end of the EEPROM, parameters start
+// at 0 and may use everything below PARAM_EE_END
+#ifndef CRON_EE_ADDR
+#define CRON_EE_ADDR (E2END + 1 - MB_CRON*MAX_CRON_JOBS*sizeof(CRON_ENTRY))
+#endif
+
+#ifndef SCRIPT_EE_ADDR
+#define SCRIPT_EE_ADDR (CRON_EE_ADDR - MB_SCRIPTS*MAX_EE_SCRIPTS*sizeof(EE_SCRIPT))
+#endif
+
+#define PARAM_EE_END SCRIPT_EE_ADDR
+
+// EEPROM addresses are kept as numbers, eeprom_*() takes them as pointers
+#define EE_PTR(addr) ((uint8_t*)(uintptr_t)(addr))
+#define CRON_EE(job) (CRON_EE_ADDR + (job)*sizeof(CRON_ENTRY))
+#define SCRIPT_EE(ee) (SCRIPT_EE_ADDR + (ee)*sizeof(EE_SCRIPT))
+
+// All shell output goes through this Print so it can be accounted
+class microBoxOut : public Print
+{
+public:
+    microBoxOut();
+    virtual size_t write(uint8_t ch);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    void Flush();
+    void Drain();
+
+    unsigned long bytesOut;
+    uint16_t flushes;
+    uint16_t holdMs;        // max delay for held echo output
+    bool echo;              // output is echo of typed input
+#if MB_RPC
+    bool json;              // escape output as JSON string content
+#endif
+
+private:
+#if MB_RPC
+    size_t WriteJson(uint8_t ch);
+#endif
+    void Put(const uint8_t *pData, uint8_t len);
+
+    uint8_t buf[MAX_OUT_BUF];
+    uint8_t bufLen;
+    bool held;
+    unsigned long holdStart;
+};
+
 class microBox
 {
 public:
     microBox();
     ~microBox();
-    void begin(PARAM_ENTRY *pParams, const char* hostName, bool localEcho=true, char *histBuf=NULL, int historySize=0);
-    void cmdParser();
+    bool begin(const PARAM_ENTRY *pParams, const char* hostName, bool localEcho=true, char *histBuf=NULL, int historySize=0);
+    void SetParamIndex(uint8_t *pIndex, uint8_t size);
+    void cmdParser(unsigned long budgetUs=0);
     bool isTimeout(unsigned long *lastTime, unsigned long intervall);
+    // Commands print through microbox.out. Output written to Serial
+    // directly bypasses the JSON escaping and breaks rpc replies.
     bool AddCommand(const char *cmdName, void (*cmdFunc)(char **param, uint8_t parCnt));
+    bool AddCommand(const char *cmdName, uint8_t (*resFunc)(char **param, uint8_t parCnt, CMD_STATE *pState));
+#if MB_SCRIPTS
+    bool AddScript(const char *name, const char *script);
+#endif
+    void SetOutputHold(uint16_t ms);
+    uint8_t ArgLen(uint8_t n);
+    void ParamWriteBegin();
+    void ParamWriteEnd();
+    bool SnapshotParams(const uint8_t *pIdx, PARAM_VALUE *pVals, uint8_t cnt);
+    int8_t AddTask(void (*taskFunc)(uint8_t id), unsigned long period, uint8_t id=0);
+    void RemoveTask(int8_t task);
+    void SetTaskPeriod(int8_t task, unsigned long period);
+    uint16_t GetTaskOverruns(int8_t task);
+    void RunTasks();
+    unsigned long TimeToNextTask();
+#if MB_CAPTURE
+    void SetCaptureBuffer(PARAM_VALUE *pBuf, uint16_t size);
+    void CaptureTick();
+#endif
+#if MB_STATS
+    void SetStatBuffer(double *pBuf, uint16_t size);
+    bool AddStat(const char *paramName, uint8_t window, unsigned long period);
+#endif
+    bool SetMaxAge(const char *paramName, uint16_t maxAge);
+
+    microBoxOut out;        // shell output, commands should print here too
 
 private:
     static void ListDirCB(char **pParam, uint8_t parCnt);
@@ -79,24 +435,142 @@ private:
     static void watchCB(char** pParam, uint8_t parCnt);
     static void watchcsvCB(char** pParam, uint8_t parCnt);
     static void LoadParCB(char **pParam, uint8_t parCnt);
-    static void SaveParCB(char **pParam, uint8_t parCnt);
+    static uint8_t SaveParCB(char **pParam, uint8_t parCnt, CMD_STATE *pState);
+    static void TransBeginCB(char **pParam, uint8_t parCnt);
+    static void TransCommitCB(char **pParam, uint8_t parCnt);
+    static void TransAbortCB(char **pParam, uint8_t parCnt);
+    static void PsCB(char **pParam, uint8_t parCnt);
+    static void JobTaskCB(uint8_t id);
+    static void CacheStatCB(char **pParam, uint8_t parCnt);
+    static void TimeCB(char **pParam, uint8_t parCnt);
+#if MB_JOBS
+    static void JobsCB(char **pParam, uint8_t parCnt);
+    static void KillCB(char **pParam, uint8_t parCnt);
+#endif
+#if MB_CRON
+    static void CronCB(char **pParam, uint8_t parCnt);
+    static void CronTaskCB(uint8_t id);
+#endif
+#if MB_CAPTURE
+    static void CaptureCB(char **pParam, uint8_t parCnt);
+    static void CaptureTaskCB(uint8_t id);
+#endif
+#if MB_STATS
+    static void StatsCB(char **pParam, uint8_t parCnt);
+    static void StatTaskCB(uint8_t id);
+#endif
+#if MB_RPC
+    static void RpcCB(char **pParam, uint8_t parCnt);
+#endif
+#if MB_SCRIPTS
+    static void ScriptCB(char **pParam, uint8_t parCnt);
+#endif
 
     void ListDir(char **pParam, uint8_t parCnt, bool listLong=false);
     void ChangeDir(char **pParam, uint8_t parCnt);
     void Echo(char **pParam, uint8_t parCnt);
     void Cat(char** pParam, uint8_t parCnt);
+    bool CatRow(uint8_t *pIdx, uint8_t cnt, bool withName);
     void watch(char** pParam, uint8_t parCnt);
     void watchcsv(char** pParam, uint8_t parCnt);
+    void TransBegin();
+    void TransCommit();
+    void TransAbort();
+    void Ps(char **pParam, uint8_t parCnt);
+    void CacheStat(char **pParam, uint8_t parCnt);
+    void Time(char **pParam, uint8_t parCnt);
+#if MB_JOBS
+    void Jobs(char **pParam, uint8_t parCnt);
+    void Kill(char **pParam, uint8_t parCnt);
+#endif
+#if MB_CRON
+    void Cron(char **pParam, uint8_t parCnt);
+#endif
+#if MB_CAPTURE
+    void Capture(char **pParam, uint8_t parCnt);
+#endif
+#if MB_STATS
+    void Stats(char **pParam, uint8_t parCnt);
+#endif
+#if MB_RPC
+    void Rpc(char **pParam, uint8_t parCnt);
+#endif
+#if MB_SCRIPTS
+    void Script(char **pParam, uint8_t parCnt);
+#endif
 
 private:
     void ShowPrompt();
-    uint8_t ParseCmdParams(char *pParam);
+    uint8_t Tokenize(char *pLine, char **ppNext, char *pOp, bool *pBg);
+    void TokenEnd(uint8_t tok, char *pEnd);
     void ErrorDir(const __FlashStringHelper *cmd);
-    char *GetDir(char *pParam, bool useFile);
-    char *GetFile(char *pParam);
+    void PrintError(const __FlashStringHelper *pMsg);
+    char *ResolvePath(const char *pParam);
+    uint8_t GetNode(char *pPath, int16_t *pIdx);
+    bool BuildParamIndex();
+    uint8_t LowerBound(const char *pName, uint8_t len);
+    int16_t FindParam(const char *pName, uint8_t len);
+    bool IsParamDir(const char *pName, uint8_t len);
+    bool HasGlob(const char *pParam);
+    bool MatchGlob(const char *pPat, const char *pName);
+    uint8_t ExpandParams(char *pParam, uint8_t *pPos, uint8_t *pIdxList, uint8_t maxCnt);
+    void ListPath(char *pDir, bool listLong);
+    void ListParams(char *pDir, bool listLong);
+    void ListParamHlp(uint8_t idx, bool listLong);
+    uint8_t ParamSize(uint8_t idx);
+    uint8_t CompleteParam(char *pParam);
     void PrintParam(uint8_t idx);
-    int8_t GetParamIdx(char* pParam, bool partStr = false, int8_t startIdx = 0);
+    void ReadParam(uint8_t idx, PARAM_VALUE *pVal);
+    void GetParam(uint8_t idx);
+    void InvalidateParam(uint8_t idx);
+    CACHE_ENTRY *FindCache(uint8_t idx);
+    void CopyParam(uint8_t idx, PARAM_VALUE *pVal);
+    void PrintParamVal(uint8_t idx, PARAM_VALUE *pVal, bool withName=false);
+    bool EchoParam(uint8_t idx, char *pVal);
+    void StartWatch(char **pParam, uint8_t parCnt, bool csv);
+    void WatchOnce(char **pParam, uint8_t parCnt, bool csv);
+    bool RunJob(uint8_t job);
+    void RunTaskJob(uint8_t job, bool cron);
+    void RunDeferred();
+    void KillJob(uint8_t job);
+    bool JoinParams(char *pDst, char **pParam, uint8_t parCnt);
+#if MB_CAPTURE || MB_STATS
+    double ParamToDouble(uint8_t idx, PARAM_VALUE *pVal);
+#endif
+#if MB_CAPTURE
+    void CaptureSample();
+    void CaptureStatus();
+    void CaptureDump(bool binary);
+    void WriteVarint(unsigned int val);
+#endif
+#if MB_STATS
+    bool AddStatIdx(uint8_t idx, uint8_t window, unsigned long period);
+    void RemoveStat(uint8_t stat);
+    void StatSample(uint8_t stat);
+    int8_t GetStatIdx(char *pParam);
+    int8_t FindStat(const char *pName, uint8_t len);
+    const char *StatEntry(uint8_t stat, const char *pDir, uint8_t len);
+    void ListStats(char *pDir, bool listLong);
+    void PrintStat(uint8_t stat);
+#endif
+    char *GetProcPath(char *pParam);
+    bool CatProcFile(char *pParam);
+    void ParserRun();
+    bool BudgetLeft();
+    void ReadAhead();
+    bool InputAvailable();
+    uint8_t ReadInput();
+    void PaintStack();
+    bool ParseParamVal(uint8_t idx, char *pStr, PARAM_VALUE *pVal);
+    void StoreParam(uint8_t idx, PARAM_VALUE *pVal, const char *pStr);
+    bool StageParam(uint8_t idx, char *pStr);
+    int16_t GetParamIdx(char* pParam);
     int8_t GetCmdIdx(char* pCmd, int8_t startIdx = 0);
+    PARAM_ENTRY Param(uint8_t idx);
+    const char *CmdName(uint8_t idx, char *pBuf);
+    bool IsResCmd(uint8_t idx);
+    void CallCmd(uint8_t idx, char **pParam, uint8_t parCnt);
+    uint8_t CallResCmd(uint8_t idx, char **pParam, uint8_t parCnt);
     uint8_t Cat_int(char* pParam);
     void ListDirHlp(bool dir, bool rw = true, int len=4096);
     uint8_t ParCmp(uint8_t idx1, uint8_t idx2, bool cmd=false);
@@ -106,34 +580,157 @@ private:
     void HistoryPrintHlpr();
     void AddToHistory(char *buf);
     void ExecCommand();
+#if MB_RPC
+    void ExecRpc();
+    void RpcBegin(const __FlashStringHelper *pKey, const char *pId);
+    void RpcEnd();
+#endif
+    bool Dispatch(uint8_t tokCnt, bool background=false);
+    bool RunChain(char *pLine, bool background=false, char op=';');
+#if MB_SCRIPTS
+    int8_t LoadScript(char *pName, uint8_t len, char *pRest, char restOp);
+    int8_t FindEEScript(const char *pName, uint8_t len);
+#endif
+    bool AddCmdEntry(const char *cmdName, void (*cmdFunc)(char **param, uint8_t parCnt),
+                     uint8_t (*resFunc)(char **param, uint8_t parCnt, CMD_STATE *pState));
+    void ResumeCommand(char **pParam, uint8_t parCnt);
+#if MB_CRON
+    void LoadCron();
+    bool ReadCron(uint8_t job, CRON_ENTRY *pEntry);
+    uint8_t CronCheck(CRON_ENTRY *pEntry);
+    void RunCronJob(uint8_t job);
+#endif
     void handleTelnet(uint8_t ch);
     void sendTelnetOpt(uint8_t option, uint8_t value);
     double parseFloat(char *pBuf);
+    bool ParseNumber(const char *pStr, unsigned long *pVal);
     bool HandleEscSeq(unsigned char ch);
     void ReadWriteParamEE(bool write);
+    uint8_t SavePar(CMD_STATE *pState);
+    void EeWriterTick();
+    int ParamImageSize();
+    void LatchParam(uint8_t idx, uint8_t off);
 
 private:
     char currentDir[MAX_PATH_LEN];
 
     char cmdBuf[MAX_CMD_BUF_SIZE];
-    char dirBuf[15];
-    char *ParmPtr[10];
+    char pathBuf[MAX_PATH_LEN];
+    char *ParmPtr[MAX_CMD_PARAMS + 2];     // command name, parameters, NULL
+    uint8_t ParmLen[MAX_CMD_PARAMS + 1];
     uint8_t bufPos;
-    bool watchMode;
     bool csvMode;
     uint8_t escSeq;
-    unsigned long watchTimeout;
+    JOB_ENTRY jobs[MAX_JOBS];
+    int8_t fgJob;
+#if MB_RPC
+    uint8_t deferredJobs;   // bit per job, waiting for an rpc reply to end
+    uint8_t deferredCron;
+#endif
+    bool bgExec;
+    bool jobExec;           // a watch or cron job is running
+    volatile uint8_t paramSeq;
+    bool transMode;
+    uint8_t transCnt;
+    uint8_t transStrPos;
+    TRANS_ENTRY transEntries[MAX_TRANS_ENTRIES];
+    char transStrBuf[MAX_TRANS_STRBUF];
+    CACHE_ENTRY cacheEntries[MAX_CACHED_PARAMS];
+    TASK_ENTRY tasks[MAX_TASKS];
+#if MB_CRON
+    int8_t cronTasks[MAX_CRON_JOBS];
+#endif
+    bool started;           // boot jobs wait for the first cmdParser() run
+#if MB_SCRIPTS
+    SCRIPT_ENTRY scripts[MAX_SCRIPTS];
+    char scriptBuf[MAX_SCRIPT_LEN + MAX_CMD_BUF_SIZE];
+    bool scriptActive;
+#endif
+    char *chainNext;
+    char chainOp;
+    uint8_t eeState;
+    uint8_t eeIdx;
+    uint8_t eeOff;
+    uint8_t eePass;
+    bool eeClean;
+    uint8_t eeSeq;          // paramSeq when the pass started
+    int eePos;
+    int eeSize;
+    uint16_t eeBytes;
+    uint8_t eeStage[MAX_EE_STAGE];
+    int8_t resCmd;
+    bool resPrompt;
+    bool resBg;
+#if MB_CAPTURE
+    PARAM_VALUE *capBuf;
+    uint16_t capSize;
+    uint8_t capIdx[MAX_CAPTURE_CHANNELS];
+    uint8_t capChannels;
+    uint16_t capRate;
+    int8_t capTask;
+    uint8_t capTrigMode;
+    double capTrigLevel;
+    uint16_t capPre;
+    double capLast;
+    volatile uint8_t capState;
+    volatile uint16_t capWr;
+    volatile uint16_t capCount;
+    volatile uint16_t capPost;
+    volatile int16_t capTrigPos;
+#endif
+#if MB_STATS
+    STAT_ENTRY stats[MAX_STATS];
+    double *statBuf;
+    uint16_t statBufSize;
+    uint16_t statBufUsed;
+#endif
+    uint8_t userCmdCnt;
+    unsigned long parserStart;
+    unsigned long parserBudget;
+    uint8_t taskNext;
+    uint8_t typeAhead[MAX_TYPEAHEAD];
+    uint8_t taLen;
+    uint8_t taPos;
+    uint16_t budgetOverruns;
+    unsigned long getFuncCalls;
+    unsigned long setFuncCalls;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+#if MB_PROFILING
+    unsigned long parserCalls;
+    unsigned long parserTotalUs;
+    unsigned long parserMaxUs;
+    unsigned long bytesIn;
+    uint16_t charsDropped;
+    uint16_t telnetRecv;
+    uint16_t telnetSent;
+    uint16_t cmdCalls[MAX_CMD_NUM];
+    unsigned long cmdMaxUs[MAX_CMD_NUM];
+#endif
+    CMD_STATE resState;
     const char* machName;
     int historyBufSize;
     char *historyBuf;
     int historyWrPos;
     int historyCursorPos;
     bool locEcho;
+#if MB_RPC
+    bool rpcMode;
+    bool rpcFrame;
+    bool lineDropped;
+#endif
+    uint8_t cmdStatus;
     uint8_t stateTelnet;
 
-    static CMD_ENTRY Cmds[MAX_CMD_NUM];
-    PARAM_ENTRY *Params;
+    static const BUILTIN_CMD builtinCmds[MB_BUILTIN_CMDS] PROGMEM;
+    CMD_ENTRY userCmdList[MAX_USER_CMDS];
+    const PARAM_ENTRY *Params;
+    uint8_t paramCnt;       // parameters in the index, the shell sees these
+    uint8_t *paramOrder;
+    uint8_t paramOrderSize;
+    uint8_t paramOrderBuf[MAX_PARAMS];
     static const char dirList[][5] PROGMEM;
+    static const char procFiles[][8] PROGMEM;
 };
 
 extern microBox microbox;
@@ -0,0 +1,200 @@
+/*
+  device.cpp - Simulated device for mbreplay: a large PARAM_ENTRY table
+  (multi zone controller) and a few user commands. The corpus sessions
+  were typed against this table.
+  Released under GPLv3.
+*/
+
+#include <stdio.h>
+#include <microBox.h>
+
+#define ZONES 8
+#define MOTORS 4
+#define ADCS 16
+
+typedef struct
+{
+    double temp;
+    double setpoint;
+    double kp;
+    double ki;
+    double kd;
+    int out;
+    int mode;
+    int alarm;
+}ZONE;
+
+typedef struct
+{
+    int speed;
+    int target;
+    int current;
+    unsigned int accel;
+    int fault;
+}MOTOR;
+
+char hostname[16] = "replay";
+char fwVersion[] = "2.4.1";
+char netIp[16] = "192.168.1.50";
+char netMask[16] = "255.255.255.0";
+char netGw[16] = "192.168.1.1";
+unsigned int netPort = 23;
+int logLevel = 2;
+unsigned int uptime;
+unsigned int loopUs;
+int adcVal[ADCS];
+ZONE zone[ZONES];
+MOTOR motor[MOTORS];
+unsigned long adcReads;
+uint8_t paramIndex[128];
+
+void GetUptime(uint8_t id)
+{
+    uptime = millis() / 1000;
+}
+
+void ReadAdc(uint8_t id)
+{
+    adcReads++;
+    adcVal[id] = (int)((millis() / 7 + id * 61) % 1024);
+}
+
+void SetZone(uint8_t id)
+{
+    if(zone[id].mode == 0)
+        zone[id].out = 0;
+}
+
+#define ADC(n) mb::param("adc/" #n, adcVal[n], mb::ro, NULL, ReadAdc, n)
+
+#define ZONE_PARAMS(n) \
+    mb::param("zone/" #n "/temp", zone[n].temp, mb::ro), \
+    mb::param("zone/" #n "/setpoint", zone[n].setpoint, mb::rw | mb::atomic, SetZone, NULL, n), \
+    mb::param("zone/" #n "/kp", zone[n].kp, mb::rw | mb::atomic, SetZone, NULL, n), \
+    mb::param("zone/" #n "/ki", zone[n].ki, mb::rw | mb::atomic, SetZone, NULL, n), \
+    mb::param("zone/" #n "/kd", zone[n].kd, mb::rw | mb::atomic, SetZone, NULL, n), \
+    mb::param("zone/" #n "/out", zone[n].out, mb::ro), \
+    mb::param("zone/" #n "/mode", zone[n].mode, mb::rw, SetZone, NULL, n), \
+    mb::param("zone/" #n "/alarm", zone[n].alarm, mb::ro)
+
+#define MOTOR_PARAMS(n) \
+    mb::param("motor/" #n "/speed", motor[n].speed, mb::ro), \
+    mb::param("motor/" #n "/target", motor[n].target, mb::rw), \
+    mb::param("motor/" #n "/current", motor[n].current, mb::ro), \
+    mb::param("motor/" #n "/accel", motor[n].accel, mb::rw), \
+    mb::param("motor/" #n "/fault", motor[n].fault, mb::ro)
+
+const PARAM_ENTRY Params[] PROGMEM =
+{
+    mb::param("hostname", hostname, mb::rw),
+    mb::param("sys/version", fwVersion),
+    mb::param("sys/uptime", uptime, mb::ro, NULL, GetUptime),
+    mb::param("sys/loop_us", loopUs),
+    mb::param("sys/log_level", logLevel, mb::rw),
+    mb::param("net/ip", netIp, mb::rw),
+    mb::param("net/mask", netMask, mb::rw),
+    mb::param("net/gw", netGw, mb::rw),
+    mb::param("net/port", netPort, mb::rw),
+    ADC(0), ADC(1), ADC(2), ADC(3), ADC(4), ADC(5), ADC(6), ADC(7),
+    ADC(8), ADC(9), ADC(10), ADC(11), ADC(12), ADC(13), ADC(14), ADC(15),
+    ZONE_PARAMS(0), ZONE_PARAMS(1), ZONE_PARAMS(2), ZONE_PARAMS(3),
+    ZONE_PARAMS(4), ZONE_PARAMS(5), ZONE_PARAMS(6), ZONE_PARAMS(7),
+    MOTOR_PARAMS(0), MOTOR_PARAMS(1), MOTOR_PARAMS(2), MOTOR_PARAMS(3),
+    mb::end()
+};
+
+void getMillis(char **param, uint8_t parCnt)
+{
+    microbox.out.println(millis());
+}
+
+typedef struct
+{
+    uint8_t motor;
+    unsigned long last;
+}RAMP_STATE;
+
+// Resumable, ramps motor/N/speed to its target by accel per 10ms
+uint8_t ramp(char **param, uint8_t parCnt, CMD_STATE *pState)
+{
+    RAMP_STATE *pRamp = (RAMP_STATE*)pState->data;
+    MOTOR *pMotor;
+
+    if(pState->calls == 0)
+    {
+        if(parCnt != 1 || atoi(param[0]) >= MOTORS)
+        {
+            microbox.out.println(F("Usage: ramp motorNum"));
+            return CMD_DONE;
+        }
+        pRamp->motor = atoi(param[0]);
+        pRamp->last = millis();
+    }
+    pMotor = &motor[pRamp->motor];
+    if(pState->cancel || pMotor->fault)
+        return CMD_DONE;
+    while(millis() - pRamp->last >= 10)
+    {
+        pRamp->last += 10;
+        if(pMotor->speed < pMotor->target)
+            pMotor->speed = min(pMotor->speed + (int)pMotor->accel, pMotor->target);
+        else if(pMotor->speed > pMotor->target)
+            pMotor->speed = max(pMotor->speed - (int)pMotor->accel, pMotor->target);
+        pMotor->current = abs(pMotor->speed) / 8;
+    }
+    if(pMotor->speed == pMotor->target)
+    {
+        microbox.out.print(F("speed "));
+        microbox.out.println(pMotor->speed);
+        return CMD_DONE;
+    }
+    return CMD_BUSY;
+}
+
+void DeviceSetup()
+{
+    uint8_t i;
+    char name[8];
+
+    for(i=0;i<ZONES;i++)
+    {
+        zone[i].temp = 21.5 + i;
+        zone[i].setpoint = 60.0;
+        zone[i].kp = 2.0;
+        zone[i].ki = 0.5;
+        zone[i].kd = 0.1;
+        zone[i].mode = 1;
+    }
+    for(i=0;i<MOTORS;i++)
+        motor[i].accel = 25;
+
+    microbox.SetParamIndex(paramIndex, sizeof(paramIndex));
+    microbox.begin(Params, hostname, true);
+    // every ADC read is cached for 100ms
+    for(i=0;i<ADCS;i++)
+    {
+        snprintf(name, sizeof(name), "adc/%d", i);
+        microbox.SetMaxAge(name, 100);
+    }
+    microbox.AddCommand("millis", getMillis);
+    microbox.AddCommand("ramp", ramp);
+#if MB_SCRIPTS
+    microbox.AddScript("status", PSTR("cat -k /dev/sys/*; cat -k /dev/zone/*/temp"));
+#endif
+}
+
+// called once per replay tick, stands in for the sketch's loop()
+void DeviceLoop()
+{
+    uint8_t i;
+
+    for(i=0;i<ZONES;i++)
+    {
+        if(zone[i].mode != 0)
+        {
+            zone[i].out = (int)((zone[i].setpoint - zone[i].temp) * zone[i].kp);
+            zone[i].temp += (zone[i].setpoint - zone[i].temp) * 0.0001;
+        }
+        zone[i].alarm = zone[i].temp > 90.0;
+    }
+}
@@ -0,0 +1,283 @@
+/*
+  Arduino.cpp - Host shim to build microBox on Linux for mbreplay.
+  Released under GPLv3.
+*/
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <time.h>
+
+#define HOST_IN_SIZE 4096
+
+HardwareSerial Serial;
+
+unsigned long hostBytesOut = 0;
+unsigned long hostWrites = 0;
+FILE *hostEcho = NULL;
+
+static uint8_t inBuf[HOST_IN_SIZE];
+static size_t inRd = 0;
+static size_t inWr = 0;
+
+static unsigned long virtUs = 0;
+static unsigned long long realMark = 0;
+
+static uint8_t eeImage[E2END+1];
+static bool eeInit = false;
+
+static unsigned long long RealUs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// The clock follows the recording, real time spent inside microBox is
+// added on top so its own statistics and budgets stay meaningful.
+void HostSetTime(unsigned long us)
+{
+    unsigned long now = micros();
+
+    if((long)(us - now) > 0)
+        virtUs = us;
+    else
+        virtUs = now;
+    realMark = RealUs();
+}
+
+unsigned long micros()
+{
+    if(realMark == 0)
+        realMark = RealUs();
+    return virtUs + (unsigned long)(RealUs() - realMark);
+}
+
+unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+char *itoa(int val, char *s, int base)
+{
+    sprintf(s, (base == 16) ? "%x" : "%d", val);
+    return s;
+}
+
+void HostSerialFeed(const uint8_t *pData, size_t len)
+{
+    if(inRd == inWr)
+        inRd = inWr = 0;
+    if(len > HOST_IN_SIZE - inWr)
+        len = HOST_IN_SIZE - inWr;
+    memcpy(inBuf + inWr, pData, len);
+    inWr += len;
+}
+
+size_t HostSerialPending()
+{
+    return inWr - inRd;
+}
+
+size_t HardwareSerial::write(uint8_t ch)
+{
+    return write(&ch, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    hostBytesOut += size;
+    hostWrites++;
+    if(hostEcho != NULL)
+        fwrite(buffer, 1, size, hostEcho);
+    return size;
+}
+
+int HardwareSerial::available()
+{
+    return inWr - inRd;
+}
+
+int HardwareSerial::read()
+{
+    if(inRd == inWr)
+        return -1;
+    return inBuf[inRd++];
+}
+
+int HardwareSerial::peek()
+{
+    if(inRd == inWr)
+        return -1;
+    return inBuf[inRd];
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+
+    while(size--)
+        n += write(*buffer++);
+    return n;
+}
+
+size_t Print::print(const __FlashStringHelper *s)
+{
+    return print((const char*)s);
+}
+
+size_t Print::print(const char *s)
+{
+    return write((const uint8_t*)s, strlen(s));
+}
+
+size_t Print::print(char ch)
+{
+    return write((uint8_t)ch);
+}
+
+size_t Print::print(int val, int base)
+{
+    return print((long)val, base);
+}
+
+size_t Print::print(unsigned int val, int base)
+{
+    return print((unsigned long)val, base);
+}
+
+size_t Print::print(long val, int base)
+{
+    char buf[24];
+
+    if(base == HEX)
+        sprintf(buf, "%lX", (unsigned long)val);
+    else
+        sprintf(buf, "%ld", val);
+    return print(buf);
+}
+
+size_t Print::print(unsigned long val, int base)
+{
+    char buf[24];
+
+    sprintf(buf, (base == HEX) ? "%lX" : "%lu", val);
+    return print(buf);
+}
+
+size_t Print::print(double val, int digits)
+{
+    char buf[48];
+
+    if(isnan(val))
+        return print("nan");
+    if(isinf(val))
+        return print("inf");
+    if(val > 4294967040.0 || val < -4294967040.0)
+        return print("ovf");
+    snprintf(buf, sizeof(buf), "%.*f", digits, val);
+    return print(buf);
+}
+
+size_t Print::println(const __FlashStringHelper *s)
+{
+    return print(s) + println();
+}
+
+size_t Print::println(const char *s)
+{
+    return print(s) + println();
+}
+
+size_t Print::println(char ch)
+{
+    return print(ch) + println();
+}
+
+size_t Print::println(int val, int base)
+{
+    return print(val, base) + println();
+}
+
+size_t Print::println(unsigned int val, int base)
+{
+    return print(val, base) + println();
+}
+
+size_t Print::println(long val, int base)
+{
+    return print(val, base) + println();
+}
+
+size_t Print::println(unsigned long val, int base)
+{
+    return print(val, base) + println();
+}
+
+size_t Print::println(double val, int digits)
+{
+    return print(val, digits) + println();
+}
+
+size_t Print::println()
+{
+    return write((const uint8_t*)"\r\n", 2);
+}
+
+static uint8_t *EeImage()
+{
+    if(!eeInit)
+    {
+        memset(eeImage, 0xFF, sizeof(eeImage));
+        eeInit = true;
+    }
+    return eeImage;
+}
+
+// EEPROM addresses are small integers cast to pointers
+static size_t EeAddr(const void *pAddr, size_t len)
+{
+    size_t addr = (size_t)pAddr;
+
+    if(addr + len > E2END + 1)
+    {
+        fprintf(stderr, "eeprom: access beyond E2END at %u\n", (unsigned)addr);
+        exit(2);
+    }
+    return addr;
+}
+
+uint8_t eeprom_read_byte(const uint8_t *pAddr)
+{
+    return EeImage()[EeAddr(pAddr, 1)];
+}
+
+void eeprom_write_byte(uint8_t *pAddr, uint8_t val)
+{
+    EeImage()[EeAddr(pAddr, 1)] = val;
+}
+
+void eeprom_update_byte(uint8_t *pAddr, uint8_t val)
+{
+    eeprom_write_byte(pAddr, val);
+}
+
+void eeprom_read_block(void *pDst, const void *pSrc, size_t len)
+{
+    memcpy(pDst, EeImage() + EeAddr(pSrc, len), len);
+}
+
+void eeprom_write_block(const void *pSrc, void *pDst, size_t len)
+{
+    memcpy(EeImage() + EeAddr(pDst, len), pSrc, len);
+}
+
+void eeprom_update_block(const void *pSrc, void *pDst, size_t len)
+{
+    eeprom_write_block(pSrc, pDst, len);
+}
+
+int eeprom_is_ready()
+{
+    return 1;
+}
@@ -0,0 +1,99 @@
+/*
+  Arduino.h - Host shim to build microBox on Linux for mbreplay.
+  Only covers what microBox.cpp uses. Serial input is fed by the
+  replay tool and output is counted, the clock is virtual.
+  Released under GPLv3.
+*/
+
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) ((const __FlashStringHelper*)(s))
+
+#define DEC 10
+#define HEX 16
+
+// ATmega2560
+#define E2END 4095
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+typedef char prog_char;
+typedef bool boolean;
+typedef uint8_t byte;
+
+class __FlashStringHelper;
+
+class Print
+{
+public:
+    virtual size_t write(uint8_t ch) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+
+    size_t print(const __FlashStringHelper *s);
+    size_t print(const char *s);
+    size_t print(char ch);
+    size_t print(int val, int base=DEC);
+    size_t print(unsigned int val, int base=DEC);
+    size_t print(long val, int base=DEC);
+    size_t print(unsigned long val, int base=DEC);
+    size_t print(double val, int digits=2);
+
+    size_t println(const __FlashStringHelper *s);
+    size_t println(const char *s);
+    size_t println(char ch);
+    size_t println(int val, int base=DEC);
+    size_t println(unsigned int val, int base=DEC);
+    size_t println(long val, int base=DEC);
+    size_t println(unsigned long val, int base=DEC);
+    size_t println(double val, int digits=2);
+    size_t println();
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// Input comes from HostSerialFeed(), output is counted and optionally
+// copied to a FILE.
+class HardwareSerial : public Stream
+{
+public:
+    virtual size_t write(uint8_t ch);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+};
+
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+char *itoa(int val, char *s, int base);
+
+// host side of the shim
+void HostSerialFeed(const uint8_t *pData, size_t len);
+size_t HostSerialPending();
+extern unsigned long hostBytesOut;
+extern unsigned long hostWrites;
+extern FILE *hostEcho;
+void HostSetTime(unsigned long us);
+
+#endif
@@ -0,0 +1,20 @@
+/*
+  eeprom.h - Host shim, EEPROM addresses index a RAM image of E2END+1
+  bytes that starts erased (0xFF).
+*/
+
+#ifndef _HOST_EEPROM_H_
+#define _HOST_EEPROM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint8_t eeprom_read_byte(const uint8_t *pAddr);
+void eeprom_write_byte(uint8_t *pAddr, uint8_t val);
+void eeprom_update_byte(uint8_t *pAddr, uint8_t val);
+void eeprom_read_block(void *pDst, const void *pSrc, size_t len);
+void eeprom_write_block(const void *pSrc, void *pDst, size_t len);
+void eeprom_update_block(const void *pSrc, void *pDst, size_t len);
+int eeprom_is_ready();
+
+#endif
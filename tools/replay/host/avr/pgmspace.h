@@ -0,0 +1,26 @@
+/*
+  pgmspace.h - Host shim, flash and RAM share one address space.
+*/
+
+#ifndef _HOST_PGMSPACE_H_
+#define _HOST_PGMSPACE_H_
+
+#include <string.h>
+
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_byte_near(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define pgm_read_ptr(p) (*(void* const*)(p))
+
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strcat_P strcat
+#define memcpy_P memcpy
+#define strcspn_P strcspn
+#define strpbrk_P strpbrk
+#define strspn_P strspn
+#define strchr_P strchr
+
+#endif
@@ -0,0 +1,12 @@
+/*
+  atomic.h - Host shim, the replay is single threaded.
+*/
+
+#ifndef _HOST_ATOMIC_H_
+#define _HOST_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+#define ATOMIC_BLOCK(type) for(int _atomicDone=0;!_atomicDone;_atomicDone=1)
+
+#endif
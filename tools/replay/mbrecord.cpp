@@ -0,0 +1,247 @@
+/*
+  mbrecord.cpp - Records a microBox session for mbreplay.
+  Released under GPLv3.
+
+  usage: mbrecord [-l port] -o file.rec host:port
+         mbrecord [-l port] -o file.rec /dev/ttyUSB0 [-s baud]
+
+  Listens on a local TCP port (default 2323) and relays the first
+  connection to the device, a telnet server (e.g. microBoxEsp) or a
+  serial port. Connect with "telnet localhost 2323" and work as usual,
+  every chunk in both directions is written with its timing:
+
+    > <us since previous record> "<bytes to the device>"
+    < <us since previous record> "<bytes from the device>"
+
+  Bytes are C escaped (\r \n \t \e \\ \" \xNN), so telnet IAC and
+  terminal escape sequences are kept as they were sent.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define CHUNK_SIZE 512
+
+static FILE *pOut;
+static unsigned long long lastUs;
+
+static unsigned long long NowUs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void Record(char dir, const uint8_t *pData, ssize_t len)
+{
+    unsigned long long now = NowUs();
+    ssize_t i;
+
+    fprintf(pOut, "%c %llu \"", dir, now - lastUs);
+    lastUs = now;
+    for(i=0;i<len;i++)
+    {
+        switch(pData[i])
+        {
+        case '\r': fputs("\\r", pOut); break;
+        case '\n': fputs("\\n", pOut); break;
+        case '\t': fputs("\\t", pOut); break;
+        case 0x1B: fputs("\\e", pOut); break;
+        case '\\': fputs("\\\\", pOut); break;
+        case '"': fputs("\\\"", pOut); break;
+        default:
+            if(pData[i] < 0x20 || pData[i] >= 0x7F)
+                fprintf(pOut, "\\x%02x", pData[i]);
+            else
+                fputc(pData[i], pOut);
+        }
+    }
+    fputs("\"\n", pOut);
+    fflush(pOut);
+}
+
+static speed_t BaudRate(long baud)
+{
+    switch(baud)
+    {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    }
+    fprintf(stderr, "mbrecord: unsupported baud rate %ld\n", baud);
+    exit(2);
+}
+
+static int OpenSerial(const char *pDev, long baud)
+{
+    struct termios tio;
+    int fd;
+
+    fd = open(pDev, O_RDWR | O_NOCTTY);
+    if(fd < 0 || tcgetattr(fd, &tio) != 0)
+    {
+        perror(pDev);
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, BaudRate(baud));
+    cfsetospeed(&tio, BaudRate(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    if(tcsetattr(fd, TCSANOW, &tio) != 0)
+    {
+        perror(pDev);
+        exit(1);
+    }
+    return fd;
+}
+
+static int OpenTcp(const char *pTarget)
+{
+    struct addrinfo hints;
+    struct addrinfo *pRes;
+    char host[256];
+    const char *pPort;
+    int fd;
+
+    pPort = strrchr(pTarget, ':');
+    if(pPort == NULL || pPort - pTarget >= (long)sizeof(host))
+    {
+        fprintf(stderr, "mbrecord: target must be host:port or a device\n");
+        exit(2);
+    }
+    memcpy(host, pTarget, pPort - pTarget);
+    host[pPort - pTarget] = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, pPort + 1, &hints, &pRes) != 0)
+    {
+        fprintf(stderr, "mbrecord: cannot resolve %s\n", host);
+        exit(1);
+    }
+    fd = socket(pRes->ai_family, pRes->ai_socktype, pRes->ai_protocol);
+    if(fd < 0 || connect(fd, pRes->ai_addr, pRes->ai_addrlen) != 0)
+    {
+        perror(pTarget);
+        exit(1);
+    }
+    freeaddrinfo(pRes);
+    return fd;
+}
+
+static int AcceptClient(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int lfd;
+    int fd;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(lfd, 1) != 0)
+    {
+        perror("mbrecord");
+        exit(1);
+    }
+    fprintf(stderr, "mbrecord: waiting on localhost:%d\n", port);
+    fd = accept(lfd, NULL, NULL);
+    close(lfd);
+    if(fd < 0)
+    {
+        perror("mbrecord");
+        exit(1);
+    }
+    return fd;
+}
+
+static void Usage()
+{
+    fprintf(stderr, "usage: mbrecord [-l port] -o file.rec host:port\n"
+                    "       mbrecord [-l port] -o file.rec /dev/ttyX [-s baud]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct pollfd fds[2];
+    uint8_t buf[CHUNK_SIZE];
+    const char *pFile = NULL;
+    const char *pTarget;
+    long baud = 115200;
+    int port = 2323;
+    time_t now;
+    ssize_t len;
+    int opt;
+    int i;
+
+    while((opt = getopt(argc, argv, "l:o:s:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'l': port = atoi(optarg); break;
+        case 'o': pFile = optarg; break;
+        case 's': baud = atol(optarg); break;
+        default: Usage();
+        }
+    }
+    if(pFile == NULL || optind != argc - 1)
+        Usage();
+    pTarget = argv[optind];
+
+    pOut = fopen(pFile, "w");
+    if(pOut == NULL)
+    {
+        perror(pFile);
+        return 1;
+    }
+    fds[0].fd = AcceptClient(port);
+    fds[1].fd = (pTarget[0] == '/') ? OpenSerial(pTarget, baud) : OpenTcp(pTarget);
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    now = time(NULL);
+    fprintf(pOut, "# microBox session recording\n# target %s, %s", pTarget, ctime(&now));
+    lastUs = NowUs();
+
+    while(poll(fds, 2, -1) > 0)
+    {
+        for(i=0;i<2;i++)
+        {
+            if(fds[i].revents == 0)
+                continue;
+            len = read(fds[i].fd, buf, sizeof(buf));
+            if(len <= 0)
+            {
+                fclose(pOut);
+                return 0;
+            }
+            Record(i == 0 ? '>' : '<', buf, len);
+            if(write(fds[1-i].fd, buf, len) != len)
+            {
+                perror("mbrecord");
+                fclose(pOut);
+                return 1;
+            }
+        }
+    }
+    fclose(pOut);
+    return 0;
+}
@@ -0,0 +1,507 @@
+/*
+  mbreplay.cpp - Replays recorded sessions through microBox's cmdParser()
+  on a host build and reports latency and output statistics.
+  Released under GPLv3.
+
+  usage: mbreplay [-t tickUs] [-b budgetUs] [-o holdMs] [-g] [-v] file.rec...
+
+  Each recording is replayed in a fresh process against the simulated
+  device in device.cpp. Input bytes are delivered at their recorded
+  time, cmdParser() runs every tickUs of recorded time in between.
+
+  byte latency   time from delivering a byte until the end of the
+                 cmdParser() run that consumed it
+  command busy   time spent in cmdParser() runs that read input or wrote
+                 output, from the end of line until the next input
+  command done   time from the end of line until the last output of the
+                 command
+  output         bytes written per command, and Serial writes in total
+
+  Times are micros() of the host build: recorded time plus the real
+  time spent in microBox.
+*/
+
+#include <microBox.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_LINE 1024
+#define MAX_LABEL 40
+#define MAX_SLOWEST 5
+#define HIST_BUCKETS 24
+#define TAIL_US 2000000UL
+
+void DeviceSetup();
+void DeviceLoop();
+
+typedef struct
+{
+    unsigned long *pVal;
+    size_t cnt;
+    size_t size;
+}SAMPLES;
+
+typedef struct
+{
+    char label[MAX_LABEL];
+    unsigned long start;
+    unsigned long busy;
+    unsigned long done;
+    unsigned long out;
+    uint8_t lines;
+}CMD_SAMPLE;
+
+typedef struct
+{
+    uint8_t ch;
+    unsigned long t;
+}PENDING_BYTE;
+
+static unsigned long tickUs = 1000;
+static unsigned long budgetUs = 0;
+static int holdMs = -1;
+static bool showHist = false;
+static bool verbose = false;
+
+static SAMPLES byteLat;
+static SAMPLES cmdBusy;
+static SAMPLES cmdDone;
+static SAMPLES cmdOut;
+static CMD_SAMPLE slowest[MAX_SLOWEST];
+static CMD_SAMPLE cmd;
+static bool cmdActive = false;
+
+static PENDING_BYTE *pPending = NULL;
+static size_t pendingCnt = 0;
+static size_t pendingSize = 0;
+
+static char shadow[MAX_LABEL];
+static uint8_t shadowLen = 0;
+static bool shadowEdited = false;
+static uint8_t skipState = 0;
+static uint8_t lastCh = 0;
+
+static unsigned long passes = 0;
+static unsigned long bytesIn = 0;
+static unsigned long recordedOut = 0;
+static unsigned long timeline = 0;
+
+static void AddSample(SAMPLES *pS, unsigned long val)
+{
+    if(pS->cnt == pS->size)
+    {
+        pS->size = pS->size ? pS->size * 2 : 256;
+        pS->pVal = (unsigned long*)realloc(pS->pVal, pS->size * sizeof(unsigned long));
+        if(pS->pVal == NULL)
+        {
+            perror("mbreplay");
+            exit(1);
+        }
+    }
+    pS->pVal[pS->cnt++] = val;
+}
+
+static int CmpUL(const void *pA, const void *pB)
+{
+    unsigned long a = *(const unsigned long*)pA;
+    unsigned long b = *(const unsigned long*)pB;
+
+    return (a > b) - (a < b);
+}
+
+// nearest rank, pS must be sorted
+static unsigned long Percentile(SAMPLES *pS, uint8_t p)
+{
+    size_t rank;
+
+    if(pS->cnt == 0)
+        return 0;
+    rank = (pS->cnt * p + 99) / 100;
+    return pS->pVal[rank ? rank - 1 : 0];
+}
+
+static void PrintStat(const char *pName, SAMPLES *pS)
+{
+    qsort(pS->pVal, pS->cnt, sizeof(unsigned long), CmpUL);
+    printf("  %-18s %8lu %8lu %8lu %8lu\n", pName, (unsigned long)pS->cnt,
+           Percentile(pS, 50), Percentile(pS, 99), pS->cnt ? pS->pVal[pS->cnt-1] : 0);
+}
+
+// log2 buckets, pS must be sorted
+static void PrintHist(const char *pName, SAMPLES *pS)
+{
+    unsigned long cnt[HIST_BUCKETS];
+    unsigned long peak = 0;
+    size_t i;
+    uint8_t b;
+    uint8_t last = 0;
+
+    memset(cnt, 0, sizeof(cnt));
+    for(i=0;i<pS->cnt;i++)
+    {
+        for(b=0;b<HIST_BUCKETS-1 && (pS->pVal[i] >> b) > 1;b++)
+            ;
+        cnt[b]++;
+        if(cnt[b] > peak)
+            peak = cnt[b];
+        if(b > last)
+            last = b;
+    }
+    printf("  %s\n", pName);
+    for(b=0;b<=last && peak != 0;b++)
+    {
+        printf("    < %8lu %8lu ", 2UL << b, cnt[b]);
+        for(i=0;i<cnt[b]*40/peak;i++)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
+static void EndCommand()
+{
+    uint8_t i;
+    uint8_t pos;
+
+    if(!cmdActive)
+        return;
+    cmdActive = false;
+    AddSample(&cmdBusy, cmd.busy);
+    AddSample(&cmdDone, cmd.done);
+    AddSample(&cmdOut, cmd.out);
+    for(pos=0;pos<MAX_SLOWEST && slowest[pos].lines != 0 && slowest[pos].busy >= cmd.busy;pos++)
+        ;
+    if(pos == MAX_SLOWEST)
+        return;
+    for(i=MAX_SLOWEST-1;i>pos;i--)
+        slowest[i] = slowest[i-1];
+    slowest[pos] = cmd;
+}
+
+// Follows the typed line to label commands, skips escape and telnet
+// sequences. A line ends in the cmdParser() run that started at t,
+// lines ending in the same run count as one command.
+static void ShadowByte(uint8_t ch, unsigned long t)
+{
+    bool eol = false;
+
+    switch(skipState)
+    {
+    case 1:     // ESC
+        skipState = (ch == '[' || ch == 'O') ? 2 : 0;
+        return;
+    case 2:     // CSI, ends with a final byte
+        if(ch >= 0x40 && ch <= 0x7E)
+        {
+            skipState = 0;
+            shadowEdited = true;
+        }
+        return;
+    case 3:     // IAC
+        if(ch >= 251 && ch <= 254)
+            skipState = 4;
+        else if(ch == 250)
+            skipState = 5;
+        else
+            skipState = 0;
+        return;
+    case 4:     // IAC WILL/WONT/DO/DONT option
+        skipState = 0;
+        return;
+    case 5:     // subnegotiation up to IAC SE
+        if(ch == 255)
+            skipState = 6;
+        return;
+    case 6:
+        skipState = (ch == 240) ? 0 : 5;
+        return;
+    }
+
+    if(ch == 0x1B)
+        skipState = 1;
+    else if(ch == 255)
+        skipState = 3;
+    else if(ch == '\r' || (ch == '\n' && lastCh != '\r'))
+        eol = true;
+    else if(ch == 0x7F || ch == 0x08)
+    {
+        if(shadowLen > 0)
+            shadowLen--;
+    }
+    else if(ch == '\t' || ch == 0x03)
+        shadowEdited = true;
+    else if(ch >= 0x20 && ch < 0x7F && shadowLen < MAX_LABEL-3)
+        shadow[shadowLen++] = ch;
+    lastCh = ch;
+    if(!eol)
+        return;
+
+    if(cmdActive && cmd.start == t)
+    {
+        cmd.lines++;
+        shadowLen = 0;
+        shadowEdited = false;
+        return;
+    }
+    EndCommand();
+    memset(&cmd, 0, sizeof(cmd));
+    memcpy(cmd.label, shadow, shadowLen);
+    shadowLen = 0;
+    if(shadowEdited)
+        strcat(cmd.label, " *");
+    cmd.start = t;
+    cmd.lines = 1;
+    cmdActive = true;
+    shadowEdited = false;
+}
+
+static void Pass()
+{
+    size_t before = HostSerialPending();
+    unsigned long outBefore = hostBytesOut;
+    unsigned long start;
+    unsigned long now;
+    size_t used;
+    size_t i;
+
+    start = micros();
+    microbox.cmdParser(budgetUs);
+    now = micros();
+    passes++;
+    DeviceLoop();
+
+    used = before - HostSerialPending();
+    for(i=0;i<used;i++)
+    {
+        AddSample(&byteLat, now - pPending[i].t);
+        ShadowByte(pPending[i].ch, start);
+    }
+    if(used != 0)
+    {
+        pendingCnt -= used;
+        memmove(pPending, pPending + used, pendingCnt * sizeof(PENDING_BYTE));
+    }
+    if(cmdActive && (used != 0 || hostBytesOut != outBefore))
+    {
+        cmd.busy += now - start;
+        cmd.out += hostBytesOut - outBefore;
+        if(hostBytesOut != outBefore)
+            cmd.done = now - cmd.start;
+    }
+}
+
+static void RunUntil(unsigned long due)
+{
+    while((long)(due - timeline) > 0)
+    {
+        timeline = ((long)(due - timeline) > (long)tickUs) ? timeline + tickUs : due;
+        HostSetTime(timeline);
+        Pass();
+    }
+}
+
+static void Deliver(const uint8_t *pData, size_t len)
+{
+    unsigned long now = micros();
+    size_t i;
+
+    EndCommand();
+    if(pendingCnt + len > pendingSize)
+    {
+        pendingSize = pendingCnt + len + 256;
+        pPending = (PENDING_BYTE*)realloc(pPending, pendingSize * sizeof(PENDING_BYTE));
+        if(pPending == NULL)
+        {
+            perror("mbreplay");
+            exit(1);
+        }
+    }
+    for(i=0;i<len;i++)
+    {
+        pPending[pendingCnt].ch = pData[i];
+        pPending[pendingCnt].t = now;
+        pendingCnt++;
+    }
+    HostSerialFeed(pData, len);
+    bytesIn += len;
+    Pass();
+}
+
+static int HexVal(char ch)
+{
+    if(ch >= '0' && ch <= '9')
+        return ch - '0';
+    if(ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if(ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// "..." with C escapes \r \n \t \e \\ \" \xNN, returns length or -1
+static int Unescape(const char *pSrc, uint8_t *pDst)
+{
+    int len = 0;
+
+    if(*pSrc++ != '"')
+        return -1;
+    while(*pSrc != '"')
+    {
+        if(*pSrc == 0)
+            return -1;
+        if(*pSrc != '\\')
+        {
+            pDst[len++] = *pSrc++;
+            continue;
+        }
+        pSrc++;
+        switch(*pSrc)
+        {
+        case 'r': pDst[len++] = '\r'; break;
+        case 'n': pDst[len++] = '\n'; break;
+        case 't': pDst[len++] = '\t'; break;
+        case 'e': pDst[len++] = 0x1B; break;
+        case '\\': pDst[len++] = '\\'; break;
+        case '"': pDst[len++] = '"'; break;
+        case 'x':
+            if(HexVal(pSrc[1]) < 0 || HexVal(pSrc[2]) < 0)
+                return -1;
+            pDst[len++] = HexVal(pSrc[1]) * 16 + HexVal(pSrc[2]);
+            pSrc += 2;
+            break;
+        default:
+            return -1;
+        }
+        pSrc++;
+    }
+    return len;
+}
+
+static void Report(const char *pFile)
+{
+    uint8_t i;
+
+    printf("%s: %lu bytes in, %lu commands, %lu bytes out in %lu writes",
+           pFile, bytesIn, (unsigned long)cmdBusy.cnt, hostBytesOut, hostWrites);
+    if(recordedOut != 0)
+        printf(" (recorded %lu)", recordedOut);
+    printf(", %lu cmdParser() runs\n", passes);
+    printf("  %-18s %8s %8s %8s %8s\n", "", "count", "p50", "p99", "max");
+    PrintStat("byte latency us", &byteLat);
+    PrintStat("command busy us", &cmdBusy);
+    PrintStat("command done us", &cmdDone);
+    PrintStat("command out bytes", &cmdOut);
+    if(showHist)
+    {
+        PrintHist("byte latency us", &byteLat);
+        PrintHist("command busy us", &cmdBusy);
+    }
+    printf("  slowest commands (busy us, out bytes):\n");
+    for(i=0;i<MAX_SLOWEST && slowest[i].lines != 0;i++)
+    {
+        printf("    %8lu %6lu  %s", slowest[i].busy, slowest[i].out, slowest[i].label);
+        if(slowest[i].lines > 1)
+            printf(" (+%u lines)", slowest[i].lines - 1);
+        putchar('\n');
+    }
+}
+
+static int Replay(const char *pFile)
+{
+    FILE *pIn;
+    char line[MAX_LINE];
+    uint8_t data[MAX_LINE];
+    char *pStr;
+    unsigned long delta;
+    unsigned long lineNum = 0;
+    int len;
+
+    pIn = fopen(pFile, "r");
+    if(pIn == NULL)
+    {
+        perror(pFile);
+        return 1;
+    }
+    if(verbose)
+        hostEcho = stdout;
+    HostSetTime(0);
+    DeviceSetup();
+    if(holdMs >= 0)
+        microbox.SetOutputHold(holdMs);
+
+    while(fgets(line, sizeof(line), pIn) != NULL)
+    {
+        lineNum++;
+        if(line[0] != '>' && line[0] != '<')
+            continue;
+        delta = strtoul(line + 1, &pStr, 10);
+        while(*pStr == ' ')
+            pStr++;
+        len = Unescape(pStr, data);
+        if(len < 0)
+        {
+            fprintf(stderr, "%s:%lu: bad record\n", pFile, lineNum);
+            fclose(pIn);
+            return 1;
+        }
+        if(line[0] == '<')
+        {
+            recordedOut += len;
+            continue;
+        }
+        RunUntil(timeline + delta);
+        Deliver(data, len);
+    }
+    fclose(pIn);
+    RunUntil(timeline + TAIL_US);
+    EndCommand();
+    if(verbose)
+        printf("\n");
+    Report(pFile);
+    return 0;
+}
+
+static void Usage()
+{
+    fprintf(stderr, "usage: mbreplay [-t tickUs] [-b budgetUs] [-o holdMs] [-g] [-v] file.rec...\n"
+                    "  -t  cmdParser() period in recorded time, default 1000\n"
+                    "  -b  cmdParser() time budget, default none\n"
+                    "  -o  SetOutputHold() for echo\n"
+                    "  -g  print log2 histograms\n"
+                    "  -v  print the shell output\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int i;
+    int status;
+    int ret = 0;
+
+    while((opt = getopt(argc, argv, "t:b:o:gv")) != -1)
+    {
+        switch(opt)
+        {
+        case 't': tickUs = strtoul(optarg, NULL, 10); break;
+        case 'b': budgetUs = strtoul(optarg, NULL, 10); break;
+        case 'o': holdMs = atoi(optarg); break;
+        case 'g': showHist = true; break;
+        case 'v': verbose = true; break;
+        default: Usage();
+        }
+    }
+    if(optind == argc || tickUs == 0)
+        Usage();
+
+    // microbox is a global, each session gets a fresh process
+    for(i=optind;i<argc;i++)
+    {
+        fflush(stdout);
+        if(fork() == 0)
+            exit(Replay(argv[i]));
+        wait(&status);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ret = 1;
+    }
+    return ret;
+}